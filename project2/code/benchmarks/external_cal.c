@@ -135,7 +135,7 @@ int main(int argc, char **argv) {
 		pthread_join(thread[i], NULL);
 
 	clock_gettime(CLOCK_REALTIME, &end);
-        printf("running time: %lu micro-seconds\n", 
+        printf("running time: %lu milli-seconds\n", 
 	       (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
 
 	printf("sum is: %d\n", sum);
@@ -26,6 +26,9 @@ void parallel_calculate(void* arg) {
 		for (i = 0; i < C_SIZE; ++i) {
 			pSum[j] += a[j][i] * i;
 		}
+#ifdef USE_MYTHREAD
+		mypthread_checkpoint(); // where MYPTHREAD_TIMER=coop may switch
+#endif
 	}
 	for (j = n; j < R_SIZE; j += thread_num) {
 		pthread_mutex_lock(&mutex);
@@ -98,7 +101,7 @@ int main(int argc, char **argv) {
 		pthread_join(thread[i], NULL);
 
 	clock_gettime(CLOCK_REALTIME, &end);
-        printf("running time: %lu micro-seconds\n", 
+        printf("running time: %lu milli-seconds\n", 
 	       (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
 
 	printf("sum is: %d\n", sum);
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#ifndef NATIVE_PTHREAD
+#include "../mypthread.h"
+#endif
+
+/* Scheduler microbenchmarks. Every measurement is taken reps times after
+ * one warm-up run and printed as a CSV row:
+ *
+ *	impl,workers,bench,threads,reps,mean,stddev,min,median,unit
+ *
+ * Built twice from this file: sched_bench against mypthread and
+ * sched_bench_native (-DNATIVE_PTHREAD) against the system pthreads, so
+ * "make bench" can put both side by side.
+ *
+ *	$ ./sched_bench [reps] [max_threads]
+ */
+
+#define DEFAULT_REPS 10
+#define DEFAULT_MAX_THREADS 64
+#define MAX_REPS 1000
+
+#define CREATE_ROUNDS 10000
+#define YIELD_ROUNDS 100000
+#define LOCK_ROUNDS 1000000
+#define CONTENDED_OPS 400000
+#define SCALING_WORK 40000000L
+
+#ifdef USE_MYTHREAD
+#define IMPL "mypthread"
+#define thread_yield mypthread_yield
+#else
+#define IMPL "pthread"
+#define thread_yield sched_yield
+#endif
+
+int reps;
+int max_threads;
+const char* worker_env; // MYPTHREAD_WORKERS, for the csv
+
+pthread_mutex_t mutex;
+long counter;
+long ops_per_thread;
+long work_per_thread;
+int yield_rounds;
+
+double now_ns() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+int cmp_double(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+void report(const char* bench, int threads, double* sample, const char* unit) {
+	double mean = 0, var = 0;
+	for (int i = 0; i < reps; i++)
+		mean += sample[i];
+	mean /= reps;
+	for (int i = 0; i < reps; i++)
+		var += (sample[i] - mean) * (sample[i] - mean);
+	if (reps > 1)
+		var /= reps - 1;
+	qsort(sample, reps, sizeof(double), cmp_double);
+	double median = reps % 2 ? sample[reps / 2] :
+		(sample[reps / 2 - 1] + sample[reps / 2]) / 2;
+	printf("%s,%s,%s,%d,%d,%.1f,%.1f,%.1f,%.1f,%s\n", IMPL, worker_env, bench,
+		threads, reps, mean, sqrt(var), sample[0], median, unit);
+	fflush(stdout);
+}
+
+/* run one measurement reps times, the first call is thrown away */
+void measure(const char* bench, int threads, double (*run)(int), const char* unit) {
+	double sample[MAX_REPS];
+	run(threads);
+	for (int i = 0; i < reps; i++)
+		sample[i] = run(threads);
+	report(bench, threads, sample, unit);
+}
+
+void* empty(void* arg) {
+	return NULL;
+}
+
+/* ns for one create followed by its join */
+double create_join(int threads) {
+	pthread_t thread;
+	double start = now_ns();
+	for (int i = 0; i < CREATE_ROUNDS; i++) {
+		pthread_create(&thread, NULL, &empty, NULL);
+		pthread_join(thread, NULL);
+	}
+	return (now_ns() - start) / CREATE_ROUNDS;
+}
+
+void* ping_pong(void* arg) {
+	for (int i = 0; i < yield_rounds; i++)
+		thread_yield();
+	return NULL;
+}
+
+/* ns per yield, with threads yielding to each other */
+double yield_switch(int threads) {
+	pthread_t thread[threads];
+	yield_rounds = YIELD_ROUNDS / threads;
+	double start = now_ns();
+	for (int i = 0; i < threads; i++)
+		pthread_create(&thread[i], NULL, &ping_pong, NULL);
+	for (int i = 0; i < threads; i++)
+		pthread_join(thread[i], NULL);
+	return (now_ns() - start) / ((double)yield_rounds * threads);
+}
+
+/* ns per lock/unlock pair nobody else wants */
+double mutex_uncontended(int threads) {
+	double start = now_ns();
+	for (int i = 0; i < LOCK_ROUNDS; i++) {
+		pthread_mutex_lock(&mutex);
+		counter++;
+		pthread_mutex_unlock(&mutex);
+	}
+	return (now_ns() - start) / LOCK_ROUNDS;
+}
+
+void* hammer(void* arg) {
+	for (long i = 0; i < ops_per_thread; i++) {
+		pthread_mutex_lock(&mutex);
+		counter++;
+		pthread_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+/* ns per lock/unlock pair with threads all going for the same mutex */
+double mutex_contended(int threads) {
+	pthread_t thread[threads];
+	ops_per_thread = CONTENDED_OPS / threads;
+	counter = 0;
+	double start = now_ns();
+	for (int i = 0; i < threads; i++)
+		pthread_create(&thread[i], NULL, &hammer, NULL);
+	for (int i = 0; i < threads; i++)
+		pthread_join(thread[i], NULL);
+	double ns = now_ns() - start;
+	if (counter != ops_per_thread * threads)
+		fprintf(stderr, "mutex_contended: counter %ld, expected %ld\n",
+			counter, ops_per_thread * threads);
+	return ns / (ops_per_thread * threads);
+}
+
+void* crunch(void* arg) {
+	unsigned long x = (unsigned long)arg;
+	for (long i = 0; i < work_per_thread; i++)
+		x = x * 6364136223846793005UL + 1442695040888963407UL;
+	return (void*)x;
+}
+
+/* ms to get a fixed amount of cpu-bound work done, split over threads */
+double scaling(int threads) {
+	pthread_t thread[threads];
+	work_per_thread = SCALING_WORK / threads;
+	double start = now_ns();
+	for (int i = 0; i < threads; i++)
+		pthread_create(&thread[i], NULL, &crunch, (void*)(long)i);
+	for (int i = 0; i < threads; i++)
+		pthread_join(thread[i], NULL);
+	return (now_ns() - start) / 1e6;
+}
+
+int main(int argc, char **argv) {
+	reps = argc > 1 ? atoi(argv[1]) : DEFAULT_REPS;
+	max_threads = argc > 2 ? atoi(argv[2]) : DEFAULT_MAX_THREADS;
+	if (reps < 1 || reps > MAX_REPS || max_threads < 1) {
+		fprintf(stderr, "usage: %s [reps (1-%d)] [max_threads]\n", argv[0], MAX_REPS);
+		return 1;
+	}
+#ifdef USE_MYTHREAD
+	worker_env = getenv("MYPTHREAD_WORKERS") ? getenv("MYPTHREAD_WORKERS") : "1";
+#else
+	worker_env = "-";
+#endif
+	pthread_mutex_init(&mutex, NULL);
+
+	printf("impl,workers,bench,threads,reps,mean,stddev,min,median,unit\n");
+	measure("create_join", 1, create_join, "ns");
+	measure("yield_switch", 2, yield_switch, "ns");
+	measure("mutex_uncontended", 1, mutex_uncontended, "ns");
+	for (int t = 1; t <= max_threads; t *= 2)
+		measure("mutex_contended", t, mutex_contended, "ns");
+	for (int t = 1; t <= max_threads; t *= 2)
+		measure("scaling", t, scaling, "ms");
+
+	pthread_mutex_destroy(&mutex);
+	return 0;
+}
@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include "../mypthread.h"
+
+/* Thread handle reuse check: create and join one thread at a time, so the
+ * same handle table slot is used over and over, well past the 2048
+ * generations a slot has. The first handle must never be given out again,
+ * and joining it must keep failing with ESRCH.
+ *
+ *	$ ./tid_reuse [rounds]	(default 10000)
+ */
+
+#define DEFAULT_ROUNDS 10000
+
+void* task(void* arg) {
+	return arg;
+}
+
+int main(int argc, char **argv) {
+	int rounds = argc > 1 ? atoi(argv[1]) : DEFAULT_ROUNDS;
+	pthread_t first, thread;
+	void* ret;
+
+	pthread_create(&first, NULL, &task, NULL);
+	pthread_join(first, NULL);
+
+	for (int i = 0; i < rounds; i++) {
+		if (pthread_create(&thread, NULL, &task, (void*)(long)i) != 0) {
+			printf("create failed after %d threads\n", i);
+			return 1;
+		}
+		if (thread == first) {
+			printf("handle %u given out again after %d threads\n", first, i);
+			return 1;
+		}
+		if (pthread_join(thread, &ret) != 0 || (long)ret != i) {
+			printf("join failed after %d threads\n", i);
+			return 1;
+		}
+	}
+	if (pthread_join(first, NULL) != ESRCH) {
+		printf("stale handle %u did not give ESRCH\n", first);
+		return 1;
+	}
+	printf("%d threads, stale handle still ESRCH\n", rounds);
+	return 0;
+}
@@ -4,13 +4,32 @@
 // username of iLab: afl59
 // iLab Server:
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <signal.h>
 #include <stdio.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <limits.h>
 #include "mypthread.h"
 
+// The library itself runs its kernel workers on native pthreads
+#undef pthread_t
+#undef pthread_create
+#undef pthread_detach
+
 #ifdef DEBUG
 #define debug(...) \
   fprintf(stderr, __VA_ARGS__);
@@ -21,64 +40,160 @@
 
 void mypthread_timer_block(void);
 void mypthread_timer_unblock(void);
-static void schedule();
+static void schedule(int reason);
+static tcb* sched_pick(worker_t* w);
+static void mypthread_ensure_init(void);
+void mypthread_tcb_free(tcb* t);
+
+// why the running thread is entering the scheduler
+enum { SCHED_TIMER, SCHED_YIELD, SCHED_BLOCK, SCHED_EXIT };
+#define SCHED_FROM_IDLE -1 // trace only: the idle loop handing out work
 
-const uint MYPTHREAD_MAX_THREAD_ID  = 50000;
 const uint MYPTHREAD_TIMER_INTERVAL = 15000;
+const uint MYPTHREAD_MIN_SLICE      = 100; // shortest remaining quantum we arm the timer for
 const uint MYPTHREAD_STACK_SIZE     = 8388608;
+const uint MYPTHREAD_MAX_WORKERS    = 64;
+const uint MYPTHREAD_MLFQ_QUANTUM[MYPTHREAD_MLFQ_LEVELS] = {5000, 10000, 20000, 40000};
+const uint MYPTHREAD_MLFQ_BOOST     = 200000; // move everything back to level 0 this often
+const uint MYPTHREAD_IDLE_STACK_SIZE = 65536;
+const uint MYPTHREAD_POOL_MAX       = 1024; // joined tcbs kept for reuse
+const uint MYPTHREAD_POOL_WARM      = 64; // of which this many keep their stack pages
+const int  MYPTHREAD_MUTEX_SPIN     = 100; // most a contended lock spins before parking
+const uint MYPTHREAD_MUTEX_STARVE   = 1000; // waiter losing this long gets the mutex handed over
+const uint MYPTHREAD_IO_THREADS     = 4; // kernel threads doing regular file I/O
+const uint MYPTHREAD_KEY_ROUNDS     = 4; // destructor passes at exit, like PTHREAD_DESTRUCTOR_ITERATIONS
+const uint MYPTHREAD_COOP_TICK      = 1000; // how often the coop watchdog looks at the workers
 
 uint mypthread_init_flag = 1;
-uint mypthread_id = 0;
+uint mypthread_nworkers = 1;
 
-queue_t *ready, *completed;
-tcb* tcb_curr;
+// What drives preemption: by default each worker's own thread cpu clock.
+// MYPTHREAD_TIMER=prof picks the old process-wide ITIMER_PROF (one worker)
+// or per-worker CLOCK_MONOTONIC timers (M:N). MYPTHREAD_TIMER=coop sends no
+// signals at all: a watchdog flags workers whose thread is out of time and
+// the thread yields at its next safepoint, see mypthread_checkpoint.
+enum { TIMER_CPU, TIMER_PROF, TIMER_COOP };
+int mypthread_timer_mode = TIMER_CPU;
+atomic_uint mypthread_live = 0; // threads that have not exited yet
 
-void queue_push(queue_t* q, tcb* data) {
-	qnode_t* node = (qnode_t*)calloc(1, sizeof(qnode_t));
-	if (node == NULL) {
-		perror("mem");
-		abort();
+queue_t *overflow, *tcb_pool;
+queue_t *tcb_reap; // dead tcbs the pool had no room for, freed by the next create
+worker_t* workers;
+static __thread worker_t* worker_curr;
+
+// Protects the shared queues (overflow, tcb_pool, tcb_reap, joiners),
+// and the handle table. Run queues are per worker and need no lock.
+atomic_flag sched_lock = ATOMIC_FLAG_INIT;
+
+// Idle workers sleep here until something becomes runnable
+sem_t idle_sem;
+atomic_uint idle_workers = 0;
+// or, one of them at a time, in epoll_wait until this eventfd is written
+int io_wakefd = -1;
+atomic_int io_poller_blocked = 0;
+
+#ifdef MLFQ
+// Run queue deques in use: one per MLFQ level, or STCF's two
+#define MYPTHREAD_RQ_COUNT MYPTHREAD_MLFQ_LEVELS
+#else
+#define MYPTHREAD_RQ_COUNT 2
+#endif
+
+// Bumped every MYPTHREAD_MLFQ_BOOST; a tcb or worker behind it gets boosted
+atomic_uint mlfq_epoch = 0;
+atomic_long mlfq_next_boost = 0;
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+long mypthread_clock_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// cpu time of the calling kernel thread, i.e. of this worker
+long mypthread_cpu_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+void spin_lock(atomic_flag* lock) {
+	int spins = 0;
+	while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire)) {
+		// the holder may be a descheduled kernel thread, don't burn its slice
+		if (++spins % 128 == 0)
+			sched_yield();
 	}
+}
+
+void spin_unlock(atomic_flag* lock) {
+	atomic_flag_clear_explicit(lock, memory_order_release);
+}
+
+void sched_lock_acquire(void) {
+	spin_lock(&sched_lock);
+}
+
+void sched_lock_release(void) {
+	spin_unlock(&sched_lock);
+}
+
+// User threads migrate between workers, so this must be re-read after every
+// switch. The barrier keeps gcc from caching the TLS load across calls.
+static __attribute__((noinline)) worker_t* worker_self(void) {
+	asm volatile("" ::: "memory");
+	return worker_curr;
+}
+
+// Running thread without blocking the timer: retry if we were switched out
+// (and maybe moved to another worker) between reading the worker and its curr.
+// Main has no worker until the library is set up, so a lock, condition
+// variable or barrier used before the first create sets it up here.
+static tcb* mypthread_current(void) {
+	worker_t* w;
+	uint n;
+	tcb* t;
+	if (worker_self() == NULL)
+		mypthread_ensure_init();
+	do {
+		w = worker_self();
+		n = atomic_load(&w->nswitch);
+		t = w->curr;
+	} while (w != worker_self() || n != atomic_load(&w->nswitch));
+	return t;
+}
+
+void queue_push(queue_t* q, tcb* data) {
+	// No allocation here: this runs inside the SIGPROF handler and could
+	// otherwise deadlock on malloc's lock held by the interrupted thread
+	qnode_t* node = &data->node;
 	q->size++;
 	node->next = NULL;
 	node->data = data;
 	if (q->head == NULL) {
 		q->head = node;
-		return;
-    	}
-	qnode_t* curr = q->head;
-	qnode_t* prev = curr;
-	while(curr != NULL && curr->data->age <= node->data->age) {
-		prev = curr;
-		 curr = curr->next;
-	}
-	if (curr == q->head) {
-		// insert as head
-		q->head = node;
 	} else {
-		prev->next = node;
+		q->tail->next = node;
 	}
-	node->next = curr;
+	q->tail = node;
 }
 
-int queue_is_empty(queue_t* q) {
-	if (q->head == NULL) return 1;
-	return 0;
+void queue_push_front(queue_t* q, tcb* data) {
+	qnode_t* node = &data->node;
+	q->size++;
+	node->data = data;
+	node->next = q->head;
+	q->head = node;
+	if (q->tail == NULL) q->tail = node;
 }
 
-int queue_is_member(queue_t* q, mypthread_t tid) {
-	if (q->head == NULL) return 0;
-	tcb* data = NULL;
-	qnode_t* curr = q->head;
-	qnode_t* prev = curr;
-	while(curr != NULL && curr->data->tid != tid) {
-		prev = curr;
-		curr = curr->next;
-	}
-	if (curr != NULL) {
-		return 1;
-	}
-
+int queue_is_empty(queue_t* q) {
+	if (q->head == NULL) return 1;
 	return 0;
 }
 
@@ -88,325 +203,2694 @@ tcb* queue_pop(queue_t* q) {
 	q->size--;
 	qnode_t* node = q->head;
 	q->head = q->head->next;
+	if (q->head == NULL) q->tail = NULL;
 	tcb* data = node->data;
-	free(node);
 	return data;
 }
 
-tcb* queue_remove(queue_t* q, mypthread_t tid) {
-	if (q->head == NULL) return NULL;
-	tcb* data = NULL;
-	qnode_t* curr = q->head;
-	qnode_t* prev = curr;
-	while(curr != NULL && curr->data->tid != tid) {
-		prev = curr;
-		curr = curr->next;
-	}
-	if (curr != NULL) {
-		q->size--;
-		// curr is found
-		data = curr->data;
-		if (prev == curr) {
-			// found is the head
-			q->head = curr->next;
-		} else {
-			// found is NOT the head
-			prev->next = curr->next;
+// ** THREAD HANDLES **
+// A mypthread_t is a slot in the handle table (low MYPTHREAD_TID_BITS bits)
+// and that slot's generation. Slots are reused oldest first and bump their
+// generation every time, so a stale handle finds ESRCH rather than a later
+// thread. A slot whose generation has run out after 2048 threads is retired
+// instead of wrapping, so no handle is ever given out twice; the table
+// has room for two billion threads over the life of the process. The table
+// is a directory of fixed chunks: a lookup is two loads and growing moves
+// nothing. All under sched_lock.
+
+#define MYPTHREAD_TID_BITS 20
+#define MYPTHREAD_TID_CHUNK 4096
+#define MYPTHREAD_TID_GEN_MASK 0x7ff // tids stay positive ints, -1 means nobody
+#define TID_NONE UINT_MAX // end of the slot free list
+
+typedef struct tid_slot {
+	tcb* t;
+	uint gen;
+	uint next; // free list link
+} tid_slot_t;
+
+tid_slot_t* tid_chunks[(1 << MYPTHREAD_TID_BITS) / MYPTHREAD_TID_CHUNK];
+uint tid_slots = 0; // slots handed out so far, all below this have a chunk
+uint tid_free_head = TID_NONE;
+uint tid_free_tail = TID_NONE;
+
+static tid_slot_t* tid_slot(uint index) {
+	return &tid_chunks[index / MYPTHREAD_TID_CHUNK][index % MYPTHREAD_TID_CHUNK];
+}
+
+// Give t a handle, EAGAIN once all 2^MYPTHREAD_TID_BITS slots are live or retired
+static int tid_alloc(tcb* t) {
+	uint index = tid_free_head;
+	if (index != TID_NONE) {
+		tid_free_head = tid_slot(index)->next;
+		if (tid_free_head == TID_NONE) tid_free_tail = TID_NONE;
+	} else {
+		if (tid_slots == 1 << MYPTHREAD_TID_BITS) return EAGAIN;
+		index = tid_slots;
+		if (index % MYPTHREAD_TID_CHUNK == 0) {
+			tid_slot_t* chunk = calloc(MYPTHREAD_TID_CHUNK, sizeof(tid_slot_t));
+			if (chunk == NULL) return EAGAIN;
+			tid_chunks[index / MYPTHREAD_TID_CHUNK] = chunk;
 		}
-		free(curr);
+		tid_slots++;
 	}
+	tid_slot_t* s = tid_slot(index);
+	s->t = t;
+	t->tid = s->gen << MYPTHREAD_TID_BITS | index;
+	return 0;
+}
 
-	return data;
+// The thread behind a handle, NULL once it has been joined or reclaimed
+static tcb* tid_lookup(mypthread_t tid) {
+	uint index = tid & ((1 << MYPTHREAD_TID_BITS) - 1);
+	if (index >= tid_slots) return NULL;
+	tid_slot_t* s = tid_slot(index);
+	return s->gen == tid >> MYPTHREAD_TID_BITS ? s->t : NULL;
 }
 
-// ** SIGNAL BLOCKING AND HANDLING STUFF **
+// Retire a handle. No allocation: exits come here from the switch path.
+static void tid_release(mypthread_t tid) {
+	uint index = tid & ((1 << MYPTHREAD_TID_BITS) - 1);
+	tid_slot_t* s = tid_slot(index);
+	s->t = NULL;
+	if (s->gen == MYPTHREAD_TID_GEN_MASK)
+		return; // retired: stale handles keep finding nobody here
+	s->gen++;
+	s->next = TID_NONE;
+	if (tid_free_tail == TID_NONE)
+		tid_free_head = index;
+	else
+		tid_slot(tid_free_tail)->next = index;
+	tid_free_tail = index;
+}
 
-sigset_t sigprof_set;
-void mypthread_timer_block(void) {
-	if (sigprocmask(SIG_BLOCK, &sigprof_set, NULL) != 0) {
-		perror("sigprocmask");
+// ** WORK-STEALING RUN QUEUES **
+// Chase-Lev deque, "Correct and Efficient Work-Stealing for Weak Memory
+// Models" (Le et al.). A full deque moves to an array twice the size.
+// Only the owner pushes, at the bottom. Everyone takes from the top, the
+// owner included: run queues are served oldest first, so the owner's LIFO
+// pop has no use here.
+// Pushes happen inside the timer handler, so arrays come from mmap rather
+// than malloc; replaced ones are never unmapped, since a thief may still be
+// reading them, which at most doubles the memory used.
+
+wsarray_t* wsarray_new(long size) {
+	wsarray_t* a = mmap(NULL, sizeof(wsarray_t) + size * sizeof(tcb*),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (a == MAP_FAILED) return NULL;
+	a->size = size;
+	return a;
+}
+
+int wsdeque_init(wsdeque_t* d) {
+	d->array = wsarray_new(MYPTHREAD_DEQUE_SIZE);
+	return d->array == NULL ? -1 : 0;
+}
+
+// Owner only: copy the live entries [top, bottom) into a bigger array
+static wsarray_t* wsdeque_grow(wsdeque_t* d, wsarray_t* a, long top, long b) {
+	wsarray_t* bigger = wsarray_new(a->size * 2);
+	if (bigger == NULL) return NULL;
+	for (long i = top; i < b; i++)
+		atomic_store_explicit(&bigger->slot[i & (bigger->size - 1)],
+			atomic_load_explicit(&a->slot[i & (a->size - 1)], memory_order_relaxed),
+			memory_order_relaxed);
+	bigger->prev = a;
+	atomic_store_explicit(&d->array, bigger, memory_order_release);
+	return bigger;
+}
+
+int wsdeque_push(wsdeque_t* d, tcb* t) {
+	long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+	long top = atomic_load_explicit(&d->top, memory_order_acquire);
+	wsarray_t* a = atomic_load_explicit(&d->array, memory_order_relaxed);
+	if (b - top > a->size - 1 && (a = wsdeque_grow(d, a, top, b)) == NULL)
+		return -1;
+	atomic_store_explicit(&a->slot[b & (a->size - 1)], t, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	return 0;
+}
+
+tcb* wsdeque_steal(wsdeque_t* d) {
+	long top = atomic_load_explicit(&d->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+	if (top >= b) return NULL;
+	wsarray_t* a = atomic_load_explicit(&d->array, memory_order_acquire);
+	tcb* t = atomic_load_explicit(&a->slot[top & (a->size - 1)], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+			memory_order_seq_cst, memory_order_relaxed))
+		return NULL; // lost to the owner or another thief
+	return t;
+}
+
+int wsdeque_is_empty(wsdeque_t* d) {
+	return atomic_load(&d->top) >= atomic_load(&d->bottom);
+}
+
+// Oldest entry, i.e. the deque used as a FIFO. Anyone may call this; unlike
+// wsdeque_steal it only gives up once the deque is really empty.
+tcb* wsdeque_take(wsdeque_t* d) {
+	while (!wsdeque_is_empty(d)) {
+		tcb* t = wsdeque_steal(d);
+		if (t != NULL) return t;
+	}
+	return NULL;
+}
+
+// ** CONTEXT SWITCH **
+// On x86-64 a switch saves only what the ABI says a callee must preserve
+// (rbx, rbp, r12-r15, mxcsr, x87 control word) on the old stack and swaps
+// stack pointers: no signal mask syscall like swapcontext. Build with
+// -DMYPTHREAD_UCONTEXT to get the portable ucontext backend instead.
+
+#if defined(__x86_64__) && !defined(MYPTHREAD_UCONTEXT)
+#define MYPTHREAD_FAST_SWITCH 1
+
+void mypthread_switch_stack(void** save_sp, void* load_sp);
+__asm__(
+	".text\n"
+	".globl mypthread_switch_stack\n"
+	".type mypthread_switch_stack, @function\n"
+	"mypthread_switch_stack:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size mypthread_switch_stack, .-mypthread_switch_stack\n"
+);
+
+// Lay out a frame on a fresh stack that mypthread_switch_stack "returns"
+// into fn from, with the alignment fn would have after a call
+void* mypthread_stack_frame(void* stack, size_t size, void (*fn)(void)) {
+	unsigned long* top = (unsigned long*)(((unsigned long)stack + size) & ~15UL);
+	*--top = 0; // fn's own return address, never used
+	*--top = (unsigned long)fn;
+	for (int i = 0; i < 6; i++)
+		*--top = 0; // rbp rbx r12-r15
+	*--top = 0x037F00001F80UL; // default x87 control word and mxcsr
+	return top;
+}
+#endif
+
+// Set up a context (sp for the fast backend, uc otherwise) that starts
+// fn on the given stack the first time it is switched to
+void mypthread_context_make(void** sp, ucontext_t* uc, void* stack, size_t size,
+		void (*fn)(void)) {
+#ifdef MYPTHREAD_FAST_SWITCH
+	*sp = mypthread_stack_frame(stack, size, fn);
+#else
+	if (getcontext(uc) != 0) {
+		perror("getcontext");
 		abort();
 	}
+	uc->uc_stack.ss_flags = 0;
+	uc->uc_stack.ss_size = size;
+	uc->uc_stack.ss_sp = stack;
+	uc->uc_link = NULL;
+	makecontext(uc, fn, 0);
+#endif
+}
+
+// ** SIGNAL BLOCKING AND HANDLING STUFF **
+// "Blocking" the timer no longer touches the signal mask: the running thread
+// sets preempt_off and the handler backs off, leaving preempt_pending for
+// whoever clears the flag. Only the running thread ever writes its flag, so
+// a plain store does; once set we cannot migrate, so curr is stable.
+
+void mypthread_timer_block(void) {
+	tcb* t = mypthread_current();
+	if (t == NULL) return; // idle loop, never preempted
+	atomic_store_explicit(&t->preempt_off, 1, memory_order_relaxed);
+	atomic_signal_fence(memory_order_seq_cst);
 }
 
 void mypthread_timer_unblock(void) {
-	if (sigprocmask(SIG_UNBLOCK, &sigprof_set, NULL) != 0) {
-		perror("sigprocmask");
-		abort();
+	tcb* t = worker_self()->curr;
+	if (t == NULL) return;
+	atomic_signal_fence(memory_order_seq_cst);
+	atomic_store_explicit(&t->preempt_off, 0, memory_order_relaxed);
+	atomic_signal_fence(memory_order_seq_cst);
+	if (t->preempt_pending) {
+		// the tick we held off: take it now
+		mypthread_timer_block();
+		t->preempt_pending = 0;
+		schedule(SCHED_TIMER);
 	}
 }
 
 void mypthread_timer_handler(int signum, siginfo_t *info, void *context) {
-	mypthread_timer_block();
-	schedule();
+	worker_t* w = worker_self();
+	tcb* t = (w != NULL) ? w->curr : NULL;
+	if (t == NULL) {
+		// stale tick on a worker that has gone idle
+		return;
+	}
+	if (atomic_load_explicit(&t->preempt_off, memory_order_relaxed)) {
+		t->preempt_pending = 1;
+		return;
+	}
+	int saved_errno = errno;
+	atomic_store_explicit(&t->preempt_off, 1, memory_order_relaxed);
+	atomic_signal_fence(memory_order_seq_cst);
+	schedule(SCHED_TIMER);
+	errno = saved_errno;
+}
+
+void mypthread_timer_reset(void);
+
+// Start the calling worker's timer, on the worker's own kernel thread. It
+// counts that thread's cpu time, so a worker descheduled by the kernel or
+// asleep while idle is not charged and gets no stray ticks. The prof mode
+// keeps the process-wide ITIMER_PROF for a single worker; with several,
+// each gets its own timer aimed at its kernel thread, otherwise every tick
+// lands on whichever worker happens to be running.
+void mypthread_timer_start(worker_t* w) {
+	w->cpu_stamp = mypthread_cpu_ns();
+	if (mypthread_timer_mode == TIMER_COOP) {
+		// the watchdog reads this worker's cpu time from its own thread
+		if (pthread_getcpuclockid(pthread_self(), &w->cpu_clock) != 0) {
+			perror("pthread_getcpuclockid");
+			abort();
+		}
+	} else if (mypthread_timer_mode == TIMER_CPU || mypthread_nworkers > 1) {
+		struct sigevent sev = {0};
+		sev.sigev_notify = SIGEV_THREAD_ID;
+		sev.sigev_signo = SIGPROF;
+		sev._sigev_un._tid = w->ktid;
+		clockid_t clock = (mypthread_timer_mode == TIMER_CPU) ?
+			CLOCK_THREAD_CPUTIME_ID : CLOCK_MONOTONIC;
+		if (timer_create(clock, &sev, &w->timer) != 0) {
+			perror("timer_create");
+			abort();
+		}
+	}
+	mypthread_timer_reset();
 }
 
-// Register both the signal handler and the actual timer itself
+// Coop mode's stand-in for the timer signal: every tick, flag each worker
+// whose thread has used the cpu time mypthread_timer_reset gave it. Nothing
+// here touches a tcb, the running thread may be freed under us.
+static void* mypthread_watchdog(void* arg) {
+	struct timespec tick = {0, MYPTHREAD_COOP_TICK * 1000L};
+	while (1) {
+		nanosleep(&tick, NULL);
+		for (uint i = 0; i < mypthread_nworkers; i++) {
+			worker_t* w = &workers[i];
+			// no deadline until the worker has set cpu_clock
+			long deadline = atomic_load_explicit(&w->coop_deadline, memory_order_acquire);
+			if (deadline == 0 || atomic_load_explicit(&w->should_yield, memory_order_relaxed))
+				continue;
+			struct timespec now;
+			if (clock_gettime(w->cpu_clock, &now) == 0 &&
+					now.tv_sec * 1000000000L + now.tv_nsec >= deadline)
+				atomic_store_explicit(&w->should_yield, 1, memory_order_relaxed);
+		}
+	}
+	return NULL;
+}
+
+// Register the signal handler and start worker 0's timer. The handler may
+// switch threads and only come back much later (maybe on another worker),
+// so SIGPROF stays unblocked while it runs; preempt_off guards reentry.
 void mypthread_timer_init(void) {
-	sigemptyset(&sigprof_set);
-	sigaddset(&sigprof_set, SIGPROF);
+	const char* mode = getenv("MYPTHREAD_TIMER");
+	if (mode != NULL && strcmp(mode, "prof") == 0)
+		mypthread_timer_mode = TIMER_PROF;
+	if (mode != NULL && strcmp(mode, "coop") == 0) {
+		mypthread_timer_mode = TIMER_COOP;
+		pthread_t kthread;
+		if (pthread_create(&kthread, NULL, mypthread_watchdog, NULL) != 0) {
+			perror("watchdog");
+			abort();
+		}
+		mypthread_timer_start(&workers[0]);
+		return;
+	}
 
 	struct sigaction mypthread_timer_action;
 	sigset_t sigset;
-	sigfillset(&sigset);
+	sigemptyset(&sigset);
 	mypthread_timer_action.sa_mask = sigset;
 	mypthread_timer_action.sa_sigaction = mypthread_timer_handler;
-	mypthread_timer_action.sa_flags = SA_SIGINFO | SA_RESTART;
+	mypthread_timer_action.sa_flags = SA_SIGINFO | SA_RESTART | SA_NODEFER;
 	if (sigaction(SIGPROF, &mypthread_timer_action, NULL) != 0) {
 		perror("sigaction");
 		abort();
 	}
+	mypthread_timer_start(&workers[0]);
+}
 
-	struct itimerval mypthread_timer;
-	mypthread_timer.it_value.tv_sec = 0;
-	mypthread_timer.it_value.tv_usec = MYPTHREAD_TIMER_INTERVAL;
-	mypthread_timer.it_interval.tv_sec = 0;
-	mypthread_timer.it_interval.tv_usec = 0;
-	mypthread_timer.it_interval = mypthread_timer.it_value;
-	if (setitimer(ITIMER_PROF, &mypthread_timer, NULL) != 0) {
-		perror("sigaction");
-		abort();
-	}
+// Time slice of the running thread in microseconds
+uint mypthread_quantum(void) {
+#ifdef MLFQ
+	tcb* t = worker_self()->curr;
+	if (t != NULL)
+		return MYPTHREAD_MLFQ_QUANTUM[t->level];
+#endif
+	return MYPTHREAD_TIMER_INTERVAL;
 }
 
-// We need this in order to reset our timer after a context swap
+// We need this in order to reset our timer after a context swap. A thread
+// that yielded or blocked part way through its quantum only gets the rest.
+// The cpu timer is left alone if it already fires no later than that: an
+// early tick costs less than a timer_settime on every switch, and
+// schedule() just rearms for the remainder when one arrives.
 void mypthread_timer_reset(void) {
+	worker_t* w = worker_self();
+	long quantum = mypthread_quantum() * 1000L;
+	long left = quantum;
+	if (w->curr != NULL)
+		left -= w->curr->slice_ns;
+	if (left < MYPTHREAD_MIN_SLICE * 1000L)
+		left = MYPTHREAD_MIN_SLICE * 1000L;
+
+	if (mypthread_timer_mode == TIMER_COOP) {
+		atomic_store_explicit(&w->should_yield, 0, memory_order_relaxed);
+		atomic_store_explicit(&w->coop_deadline, w->cpu_stamp + left, memory_order_release);
+		return;
+	}
+
+	if (mypthread_timer_mode == TIMER_CPU) {
+		long now = w->cpu_stamp;
+		if (w->timer_deadline > now && w->timer_deadline <= now + left)
+			return;
+		struct itimerspec mypthread_timer = {{0, 0}, {0, 0}};
+		mypthread_timer.it_value.tv_sec = left / 1000000000L;
+		mypthread_timer.it_value.tv_nsec = left % 1000000000L;
+		if (timer_settime(w->timer, 0, &mypthread_timer, NULL) != 0) {
+			perror("timer_settime");
+			abort();
+		}
+		w->timer_deadline = now + left;
+		return;
+	}
+
+	if (mypthread_nworkers > 1) {
+		struct itimerspec mypthread_timer;
+		mypthread_timer.it_value.tv_sec = left / 1000000000L;
+		mypthread_timer.it_value.tv_nsec = left % 1000000000L;
+		mypthread_timer.it_interval.tv_sec = quantum / 1000000000L;
+		mypthread_timer.it_interval.tv_nsec = quantum % 1000000000L;
+		if (timer_settime(w->timer, 0, &mypthread_timer, NULL) != 0) {
+			perror("timer_settime");
+			abort();
+		}
+		return;
+	}
+
 	struct itimerval mypthread_timer;
-	mypthread_timer.it_value.tv_sec = 0;
-	mypthread_timer.it_value.tv_usec = MYPTHREAD_TIMER_INTERVAL;
-	mypthread_timer.it_interval.tv_sec = 0;
-	mypthread_timer.it_interval.tv_usec = 0;
-	mypthread_timer.it_interval = mypthread_timer.it_value;
+	mypthread_timer.it_value.tv_sec = left / 1000000000L;
+	mypthread_timer.it_value.tv_usec = (left % 1000000000L) / 1000;
+	mypthread_timer.it_interval.tv_sec = quantum / 1000000000L;
+	mypthread_timer.it_interval.tv_usec = (quantum % 1000000000L) / 1000;
 	if (setitimer(ITIMER_PROF, &mypthread_timer, NULL) != 0) {
 		perror("sigaction");
 		abort();
 	}
 }
 
-// Basic thread init function
-void mypthread_init(void) {
-	ready = (queue_t*)calloc(1, sizeof(queue_t));
-	completed = (queue_t*)calloc(1, sizeof(queue_t));
-
-	tcb_curr = calloc(1, sizeof(tcb));
-	tcb_curr->tid = mypthread_id++;
-	tcb_curr->status = 0; // 0 ready, -1 completed
-	tcb_curr->age = 0;
-	getcontext(&tcb_curr->context);
-	mypthread_timer_init();
+// Charge t, running on w, with the worker cpu time used since it was last
+// charged. Returns 1 once that adds up to a full quantum.
+static int mypthread_charge(worker_t* w, tcb* t) {
+	long now = mypthread_cpu_ns();
+	long used = now - w->cpu_stamp;
+	w->cpu_stamp = now;
+	t->stats.cpu_ns += used;
+	t->slice_ns += used;
+	return t->slice_ns >= mypthread_quantum() * 1000L;
 }
 
-// We need this function wrapper so we have a way to guarantee exiting at the end of a
-// function's runtime
-void mypthread_func_wrapper(void) {
-	mypthread_timer_block();
-	tcb* tcb_now = tcb_curr;
-	mypthread_timer_unblock();
-	void *retval = tcb_now->func(tcb_now->arg);
-	mypthread_exit(retval);
-}
+// ** TRACING AND STATISTICS **
+// Every switch charges elapsed time to the threads on both sides, so a tcb's
+// stats are exact as of its last state change. With MYPTHREAD_TRACE=<file>
+// each worker also logs its switches into a ring that only it writes, and
+// the trace is dumped to <file> at exit. Threads' final stats are kept in
+// trace_exits, preallocated since exits can't call malloc.
 
-/* create a new thread */
-int mypthread_create(mypthread_t * thread, pthread_attr_t * attr,
-                      void *(*function)(void*), void * arg) {
-	if (mypthread_init_flag) {
-		mypthread_init_flag = 0;
-		mypthread_init();
+typedef struct trace_exit {
+	long ts;
+	uint tid;
+	uint worker;
+	mypthread_stats_t stats;
+} trace_exit_t;
+
+char* trace_path;
+long trace_base; // timestamps are dumped relative to startup
+trace_exit_t* trace_exits;
+atomic_uint trace_nexits = 0;
+
+const char* mypthread_reason_name(int reason) {
+	switch (reason) {
+	case SCHED_TIMER: return "timer";
+	case SCHED_YIELD: return "yield";
+	case SCHED_BLOCK: return "block";
+	case SCHED_EXIT: return "exit";
+	default: return "idle";
 	}
+}
 
-	// create & init tcb for new thread
-	tcb* tcb_new;
-	tcb_new = calloc(1, sizeof(tcb));
-	if (tcb_new == NULL) {
-		perror("tcb mem");
-		abort();
+static void mypthread_trace_record(worker_t* w, long now, tcb* from, tcb* to, int reason) {
+	ulong h = atomic_load_explicit(&w->trace_head, memory_order_relaxed);
+	mypthread_trace_event_t* e = &w->trace[h & (MYPTHREAD_TRACE_SIZE - 1)];
+	e->ts = now;
+	e->from = (from != NULL) ? (int)from->tid : -1;
+	e->to = (to != NULL) ? (int)to->tid : -1;
+	e->reason = reason;
+	atomic_store_explicit(&w->trace_head, h + 1, memory_order_release);
+}
+
+// Switching from `from` (NULL: the idle loop) to `to` (NULL: the idle loop).
+// Called once `to` is ours, mypthread_resume has seen it off its old cpu.
+static void mypthread_account(worker_t* w, tcb* from, tcb* to, int reason) {
+	long now = mypthread_clock_ns();
+	if (from != NULL) {
+		from->stats.run_ns += now - from->stamp;
+		from->stamp = now;
+		if (reason == SCHED_TIMER) from->stats.preempted++;
+		else if (reason == SCHED_YIELD) from->stats.yields++;
+		else if (reason == SCHED_BLOCK) from->stats.blocks++;
 	}
-	tcb_new->status = 0;  // 0 ready, -1 completed
-	tcb_new->age = 0;
-	tcb_new->func = function;
-	tcb_new->arg = arg;
-	// create * init conext for new thread
-	if (getcontext(&tcb_new->context) != 0) {
-		perror("getcontext");
-		abort();
+	if (to != NULL) {
+		to->stats.ready_ns += now - to->stamp;
+		to->stamp = now;
+		to->stats.quanta++;
 	}
-	tcb_new->context.uc_stack.ss_flags = 0;
-  	tcb_new->context.uc_stack.ss_size = MYPTHREAD_STACK_SIZE;
+	if (w->trace != NULL)
+		mypthread_trace_record(w, now, from, to, reason);
+}
 
-	void* stack = malloc(MYPTHREAD_STACK_SIZE);
-	if (stack == NULL) {
-		perror("tcb stack mem");
-		abort();
-	}
-  	tcb_new->context.uc_stack.ss_sp = stack;
-	makecontext(&tcb_new->context, mypthread_func_wrapper, 1, tcb_new->tid);
+// Keep the final stats of a thread that has just exited
+static void mypthread_trace_exit(worker_t* w, tcb* t) {
+	uint i = atomic_fetch_add(&trace_nexits, 1);
+	if (i >= MYPTHREAD_TRACE_SIZE) return;
+	trace_exits[i].ts = t->stamp;
+	trace_exits[i].tid = t->tid;
+	trace_exits[i].worker = w->id;
+	trace_exits[i].stats = t->stats;
+}
 
-	// add new thread to ready queue
+int mypthread_getstats(mypthread_t thread, mypthread_stats_t *stats) {
+	int ret = ESRCH;
 	mypthread_timer_block();
-	if (mypthread_id >= MYPTHREAD_MAX_THREAD_ID) {
-		free(tcb_new->context.uc_stack.ss_sp);
-		free(tcb_new);
-		mypthread_timer_unblock();
-		return EAGAIN;
+	sched_lock_acquire();
+	tcb* t = tid_lookup(thread);
+	if (t != NULL) {
+		*stats = t->stats;
+		ret = 0;
 	}
-
-	tcb_new->tid = mypthread_id++;
-  	queue_push(ready, tcb_new);
-	*thread = tcb_new->tid;
-	debug("create thread: %d\n", tcb_new->tid);
-
+	sched_lock_release();
 	mypthread_timer_unblock();
-  	return 0;
-};
-
-/* give CPU possession to other user-level threads voluntarily */
-int mypthread_yield() {
-  	mypthread_timer_block();
-	schedule();
-	return 0;
-};
+	return ret;
+}
 
-/* terminate a thread */
-void mypthread_exit(void *value_ptr) {
-	// mark current thread as completed
-  	mypthread_timer_block();
-	debug("exit thread %d\n", tcb_curr->tid);
-	tcb_curr->status = -1;
-	tcb_curr->retval = value_ptr;
-	if (queue_is_empty(ready)) {
-	// last thread, terminate the process
-		exit(0);
+// Each worker becomes a track; every stretch a thread ran becomes a slice
+// on it, labelled with why it ended. Exited threads get an instant event
+// carrying their stats. Workers may still be recording while we read, in
+// which case the oldest events of their ring can come out garbled.
+int mypthread_trace_dump(const char *path) {
+	if (workers == NULL || workers[0].trace == NULL) return EINVAL;
+	FILE* f = fopen(path, "w");
+	if (f == NULL) return errno;
+	fprintf(f, "{\"traceEvents\":[\n");
+	const char* sep = "";
+	for (uint i = 0; i < mypthread_nworkers; i++) {
+		worker_t* w = &workers[i];
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,"
+			"\"args\":{\"name\":\"worker %u\"}}", sep, i, i);
+		sep = ",\n";
+		ulong head = atomic_load_explicit(&w->trace_head, memory_order_acquire);
+		ulong start = (head > MYPTHREAD_TRACE_SIZE) ? head - MYPTHREAD_TRACE_SIZE : 0;
+		for (ulong j = start; j + 1 < head; j++) {
+			mypthread_trace_event_t* e = &w->trace[j & (MYPTHREAD_TRACE_SIZE - 1)];
+			mypthread_trace_event_t* next = &w->trace[(j + 1) & (MYPTHREAD_TRACE_SIZE - 1)];
+			if (e->to < 0) continue; // idle
+			fprintf(f, "%s{\"name\":\"tid %d\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,"
+				"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"out\":\"%s\"}}", sep, e->to, i,
+				(e->ts - trace_base) / 1000.0, (next->ts - e->ts) / 1000.0,
+				mypthread_reason_name(next->reason));
+		}
 	}
-	schedule();
-};
+	uint nexits = atomic_load(&trace_nexits);
+	if (nexits > MYPTHREAD_TRACE_SIZE) nexits = MYPTHREAD_TRACE_SIZE;
+	for (uint i = 0; i < nexits; i++) {
+		trace_exit_t* x = &trace_exits[i];
+		fprintf(f, "%s{\"name\":\"exit tid %u\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,"
+			"\"tid\":%u,\"ts\":%.3f,\"args\":{\"cpu_ns\":%ld,\"run_ns\":%ld,\"ready_ns\":%ld,"
+			"\"blocked_ns\":%ld,\"mutex_wait_ns\":%ld,\"quanta\":%u,\"preempted\":%u,"
+			"\"yields\":%u,\"blocks\":%u}}", sep, x->tid, x->worker,
+			(x->ts - trace_base) / 1000.0, x->stats.cpu_ns, x->stats.run_ns, x->stats.ready_ns,
+			x->stats.blocked_ns, x->stats.mutex_wait_ns, x->stats.quanta,
+			x->stats.preempted, x->stats.yields, x->stats.blocks);
+	}
+	fprintf(f, "\n]}\n");
+	if (fclose(f) != 0) return errno;
+	return 0;
+}
 
+void mypthread_trace_atexit(void) {
+	if (mypthread_trace_dump(trace_path) != 0)
+		perror("mypthread trace");
+}
 
-/* Wait for thread termination */
-int mypthread_join(mypthread_t thread, void **value_ptr) {
-	while(1) {
-		mypthread_timer_block();
-		tcb* tcb_found = queue_remove(completed, thread);
-		if (tcb_found != NULL) {
-			debug("join found thread %d\n", tcb_found->tid);
-			if (value_ptr != NULL)
-				*value_ptr = tcb_found->retval;
-			mypthread_timer_unblock();
-			return thread;
-		} else {
-			schedule();
+// MYPTHREAD_TRACE names the file to dump the trace into at exit
+void mypthread_trace_init(void) {
+	trace_path = getenv("MYPTHREAD_TRACE");
+	if (trace_path == NULL || *trace_path == '\0') return;
+	trace_base = mypthread_clock_ns();
+	trace_exits = calloc(MYPTHREAD_TRACE_SIZE, sizeof(trace_exit_t));
+	for (uint i = 0; i < mypthread_nworkers; i++) {
+		workers[i].trace = calloc(MYPTHREAD_TRACE_SIZE, sizeof(mypthread_trace_event_t));
+		if (workers[i].trace == NULL || trace_exits == NULL) {
+			perror("trace mem");
+			abort();
 		}
 	}
+	atexit(mypthread_trace_atexit);
+}
 
-	mypthread_timer_unblock();
-	return 0;
-};
+#ifdef MLFQ
+// Level t queues at: its own, or a better one its mutex waiters lent it
+static uint mlfq_level(tcb* t) {
+	uint lent = atomic_load_explicit(&t->pi_level, memory_order_relaxed);
+	return (lent != 0 && lent - 1 < t->level) ? lent - 1 : t->level;
+}
+#endif
 
-/* initialize the mutex lock */
-int mypthread_mutex_init(mypthread_mutex_t *mutex,
-                          const pthread_mutexattr_t *mutexattr) {
-	atomic_flag_clear(&(mutex->flag));
-	mutex->owner = -1;
-	mutex->blocked = (queue_t*) calloc(1, sizeof(queue_t));
-	mutex->status = 1; // 1 - initialized
+// Push on the calling worker's run queue, -1 if that deque is full
+int rq_push(worker_t* w, tcb* t, int expired) {
+#ifdef MLFQ
+	uint epoch = atomic_load(&mlfq_epoch);
+	if (t->epoch != epoch) {
+		// a boost happened since this thread was last queued
+		t->epoch = epoch;
+		t->level = 0;
+	}
+	uint lvl = mlfq_level(t);
+	if (wsdeque_push(&w->rq[lvl], t) != 0) return -1;
+	w->rq_bitmap |= 1u << lvl;
 	return 0;
-};
+#else
+	// a mutex owner others wait for stays in the current round
+	if (atomic_load_explicit(&t->pi_count, memory_order_relaxed) != 0)
+		expired = 0;
+	return wsdeque_push(expired ? w->expired : w->active, t);
+#endif
+}
 
-/* aquire the mutex lock */
-int mypthread_mutex_lock(mypthread_mutex_t *mutex) {
-	if (mutex->status != 1) return EBUSY;
-	if (tcb_curr->tid == mutex->owner) return 0; // only thread owning the lock can change the owner
-	while (atomic_flag_test_and_set(&(mutex->flag))) {
-		mypthread_timer_block(); // critical section
-		tcb_curr->status = 1;  // set tcb status as blocked
-		queue_push(mutex->blocked, tcb_curr);  // add it into per mutex blocked queue
-		debug("thread %d failed to lock mutex and yield\n", tcb_curr->tid);
-		schedule(); // Yield to next
-	};
-	// debug("thread %d locked mutex\n", tcb_curr->tid);
-	mutex->owner = tcb_curr->tid;
-  	return 0;
-};
+// Hand t to its preferred worker: the lowest numbered one in its affinity
+static void mypthread_send(tcb* t) {
+	worker_t* home = &workers[__builtin_ctzl(t->affinity)];
+	spin_lock(&home->inbox_lock);
+	queue_push(&home->inbox, t);
+	spin_unlock(&home->inbox_lock);
+}
 
-/* release the mutex lock */
-int mypthread_mutex_unlock(mypthread_mutex_t *mutex) {
-	if (mutex->owner == tcb_curr->tid) {
-		mutex->owner = -1;
-		atomic_flag_clear(&(mutex->flag));
-		tcb* tcb_blocked = NULL;
-
-		if(queue_is_empty(mutex->blocked) == 0) {
-			// Optimization to avoid calling timer_block for each mutex_unlock
-			// At this point, the mutexx is unlocked
-			// If there another thread waiting between stmt and timer_block
-			// Then another thread must've locked the mutex already
-			// It must be free for the blocked thread
-			mypthread_timer_block();
-			if((tcb_blocked=queue_pop(mutex->blocked)) != NULL) {
-				tcb_blocked->status = 0;
-				queue_push(ready, tcb_blocked);
-				debug("Thread %d changed from blocked to ready\n", tcb_blocked->tid);
-			}
-			mypthread_timer_unblock();
+// Move what other workers sent us onto our own run queue
+static void mypthread_take_inbox(worker_t* w) {
+	if (queue_is_empty(&w->inbox)) return;
+	spin_lock(&w->inbox_lock);
+	queue_t inbox = w->inbox;
+	w->inbox.head = w->inbox.tail = NULL;
+	w->inbox.size = 0;
+	spin_unlock(&w->inbox_lock);
+	tcb* t;
+	while ((t = queue_pop(&inbox)) != NULL) {
+		if (rq_push(w, t, 0) != 0) {
+			sched_lock_acquire();
+			queue_push(overflow, t);
+			sched_lock_release();
 		}
-		return 0;
 	}
-	return EBUSY;
-};
-
+}
 
-/* destroy the mutex */
-int mypthread_mutex_destroy(mypthread_mutex_t *mutex) {
-	if (mutex->status != 1) return EBUSY;
-	mutex->status = 0;
-	if (tcb_curr->tid != mutex->owner) {
-		while (atomic_flag_test_and_set(&(mutex->flag))) {
-			debug("thread %d failed to lock mutex and yield\n", tcb_curr->tid);
-			mypthread_yield();
-		};
-		mutex->owner = -1;
-		atomic_flag_clear(&(mutex->flag));
-	} else {
-		mutex->owner = -1;
-		atomic_flag_clear(&(mutex->flag));
+// Queue a runnable thread on the calling worker (timer blocked). Pushes only
+// ever go to our own deque; other workers get at it by stealing.
+// Called off the workers (the I/O pool), it goes on overflow instead, and a
+// thread with affinity for other workers goes to its home worker's inbox.
+void mypthread_ready(tcb* t, int expired) {
+	worker_t* w = worker_self();
+	if (t->affinity != 0 && (w == NULL || !(t->affinity & (1UL << w->id)))) {
+		mypthread_send(t);
+	} else if (w == NULL || rq_push(w, t, expired) != 0) {
+		sched_lock_acquire();
+		queue_push(overflow, t);
+		sched_lock_release();
 	}
-	return 0;
-};
+	atomic_thread_fence(memory_order_seq_cst); // pairs with the idle check
+	if (atomic_load(&idle_workers) > 0)
+		sem_post(&idle_sem);
+	if (atomic_load(&io_poller_blocked))
+		eventfd_write(io_wakefd, 1);
+}
 
-int mypthread_context_switch(void) {
+// Block the running thread on q. The caller holds q's guard with the timer
+// blocked; we return once someone has popped us and called mypthread_unpark.
+static void mypthread_park(queue_t* q, atomic_flag* guard) {
+	tcb* t = worker_self()->curr;
+	t->status = 1;
+	queue_push(q, t);
+	spin_unlock(guard);
+	schedule(SCHED_BLOCK);
+}
 
+static void mypthread_unpark(tcb* t) {
+	long now = mypthread_clock_ns();
+	t->stats.blocked_ns += now - t->stamp;
+	t->stamp = now;
+	t->status = 0;
+	// still owed the rest of its quantum this round, see sched_stcf
+	mypthread_ready(t, 0);
 }
 
-/* Preemptive SJF (STCF) scheduling algorithm */
-static void sched_stcf() {
-  	// mypthread_timer_block();
-	if (queue_is_empty(ready)) {
-  	mypthread_timer_unblock();
-		// debug("schedule stay on\n");
-		return;
+// Second half of every context switch, run by whatever comes up next on the
+// worker: only now is the previous thread's context saved, so this is where
+// it gets queued again
+void mypthread_switch_finish(void) {
+	worker_t* w = worker_self();
+	tcb* prev = w->prev;
+	if (prev != NULL) {
+		w->prev = NULL;
+		atomic_store_explicit(&prev->on_cpu, 0, memory_order_release);
+		if (w->prev_reason == SCHED_TIMER || w->prev_reason == SCHED_YIELD) {
+			mypthread_ready(prev, 1);
+		} else if (w->prev_reason == SCHED_EXIT) {
+			// off its stack for good: joiners may have it now. Take the
+			// list first, the tcb can be reaped as soon as the lock drops.
+			if (w->trace != NULL)
+				mypthread_trace_exit(w, prev);
+			sched_lock_acquire();
+			prev->status = -1;
+			queue_t joiners = prev->joiners;
+			int detached = prev->detached;
+			if (detached)
+				tid_release(prev->tid);
+			sched_lock_release();
+			tcb* t;
+			while ((t = queue_pop(&joiners)) != NULL)
+				mypthread_unpark(t);
+			if (detached)
+				mypthread_tcb_free(prev); // nobody will join it
+		}
+		// SCHED_BLOCK: whoever wakes it queues it
 	}
-
-	tcb* tcb_saved = tcb_curr;
-	tcb_saved->age++;
-	if (tcb_saved->status == 0)
-  	queue_push(ready, tcb_saved);
-	if (tcb_saved->status == -1)
-  	queue_push(completed, tcb_saved);
-  	tcb_curr = queue_pop(ready);
-	debug("schedule from thread %d to thread %d\n", tcb_saved->tid, tcb_curr->tid);
-	mypthread_timer_reset();
-	swapcontext(&tcb_saved->context, &tcb_curr->context);
+	if (w->curr != NULL) {
+		// fresh quantum, so any tick held off before the switch is moot
+		w->curr->preempt_pending = 0;
+		mypthread_timer_reset();
+	}
+	mypthread_timer_unblock();
 }
 
-/* Preemptive MLFQ scheduling algorithm */
-static void sched_mlfq() {
-	// Your own implementation of MLFQ
-	// (feel free to modify arguments and return types)
-
-	// YOUR CODE HERE
+// Take a thread from another worker, starting after ourselves. Deques are
+// tried in index order, which for MLFQ is priority order. Affinity is only
+// a hint, so when the deques are empty we raid the inboxes too.
+tcb* mypthread_steal(worker_t* w) {
+	for (uint i = 1; i < mypthread_nworkers; i++) {
+		worker_t* victim = &workers[(w->id + i) % mypthread_nworkers];
+		for (uint q = 0; q < MYPTHREAD_RQ_COUNT; q++) {
+			tcb* t = wsdeque_steal(&victim->rq[q]);
+			if (t != NULL) {
+				debug("worker %d steals thread %d from worker %d\n", w->id, t->tid, victim->id);
+				return t;
+			}
+		}
+	}
+	for (uint i = 1; i < mypthread_nworkers; i++) {
+		worker_t* victim = &workers[(w->id + i) % mypthread_nworkers];
+		if (queue_is_empty(&victim->inbox)) continue;
+		spin_lock(&victim->inbox_lock);
+		tcb* t = queue_pop(&victim->inbox);
+		spin_unlock(&victim->inbox_lock);
+		if (t != NULL) return t;
+	}
+	return NULL;
 }
 
-/* scheduler */
-static void schedule() {
+// Refill from the shared overflow queue, which only fills up when a deque
+// does. Done at the start of every round so spilled threads still get a turn.
+tcb* mypthread_take_overflow(worker_t* w) {
+	if (queue_is_empty(overflow)) return NULL;
+	sched_lock_acquire();
+	tcb* t = queue_pop(overflow);
+	tcb* more;
+	while ((more = queue_pop(overflow)) != NULL) {
+		if (rq_push(w, more, 0) != 0) {
+			queue_push(overflow, more);
+			break;
+		}
+	}
+	sched_lock_release();
+	return t;
+}
+
+// ** I/O AND SLEEP **
+// Threads waiting on a pollable fd are registered with epoll, sleeping ones
+// sit in a heap ordered by deadline. Both are checked on timer ticks, and
+// one idle worker at a time (the poller) blocks in epoll_wait rather than
+// on idle_sem; mypthread_ready kicks it out through io_wakefd. Regular files
+// can't be polled, so reads and writes that would wait for the disk go to
+// a small pool of kernel threads that do the syscall and unpark the thread.
+
+enum { IO_READ, IO_WRITE };
+
+int io_epfd = -1;
+atomic_int io_waiters = 0; // threads parked on epoll
+atomic_int io_poller = 0; // some idle worker has taken the poller's job
+
+atomic_flag io_lock = ATOMIC_FLAG_INIT; // protects the sleep heap and io_offload
+atomic_flag io_fd_lock = ATOMIC_FLAG_INIT; // protects io_fds and their epoll entries
+queue_t* io_fds; // threads waiting on each fd, indexed by fd
+uint io_fd_cap = 0;
+tcb** sleep_heap;
+uint sleep_count = 0;
+atomic_uint io_sleepers = 0; // sleep_count, readable without io_lock
+uint sleep_cap = 0;
+queue_t io_offload; // requests for the pool
+sem_t io_offload_sem;
+pthread_once_t io_pool_once = PTHREAD_ONCE_INIT;
+
+void mypthread_io_init(void) {
+	io_epfd = epoll_create1(EPOLL_CLOEXEC);
+	io_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	struct epoll_event ev = {0};
+	ev.events = EPOLLIN;
+	ev.data.fd = io_wakefd;
+	if (io_epfd < 0 || io_wakefd < 0 ||
+			epoll_ctl(io_epfd, EPOLL_CTL_ADD, io_wakefd, &ev) != 0) {
+		perror("epoll");
+		abort();
+	}
+	sem_init(&io_offload_sem, 0, 0);
+}
+
+// unlocked, a hint: whoever changes these will poll or kick the poller
+static int mypthread_io_pending(void) {
+	return atomic_load(&io_waiters) > 0 || atomic_load(&io_sleepers) > 0;
+}
+
+static void sleep_heap_swap(uint i, uint j) {
+	tcb* t = sleep_heap[i];
+	sleep_heap[i] = sleep_heap[j];
+	sleep_heap[j] = t;
+}
+
+// io_lock held, sleep_cap already big enough
+static void sleep_heap_push(tcb* t) {
+	uint i = sleep_count++;
+	sleep_heap[i] = t;
+	while (i > 0 && sleep_heap[(i - 1) / 2]->io.wake_ns > sleep_heap[i]->io.wake_ns) {
+		sleep_heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+// io_lock held
+static tcb* sleep_heap_pop(void) {
+	tcb* top = sleep_heap[0];
+	sleep_heap[0] = sleep_heap[--sleep_count];
+	uint i = 0;
+	while (1) {
+		uint min = i, l = 2 * i + 1, r = 2 * i + 2;
+		if (l < sleep_count && sleep_heap[l]->io.wake_ns < sleep_heap[min]->io.wake_ns) min = l;
+		if (r < sleep_count && sleep_heap[r]->io.wake_ns < sleep_heap[min]->io.wake_ns) min = r;
+		if (min == i) break;
+		sleep_heap_swap(i, min);
+		i = min;
+	}
+	return top;
+}
+
+// Wake every sleeper whose deadline has passed. Returns the ms until the
+// next deadline, for epoll_wait (-1 when nobody sleeps).
+static int mypthread_wake_sleepers(void) {
+	queue_t due = {NULL, NULL, 0};
+	int timeout = -1;
+	long now = mypthread_clock_ns();
+	spin_lock(&io_lock);
+	while (sleep_count > 0 && sleep_heap[0]->io.wake_ns <= now)
+		queue_push(&due, sleep_heap_pop());
+	atomic_store(&io_sleepers, sleep_count);
+	if (sleep_count > 0) {
+		// deadlines can be years out, further than epoll_wait's int of ms
+		long ms = (sleep_heap[0]->io.wake_ns - now + 999999) / 1000000;
+		timeout = ms < INT_MAX ? ms : INT_MAX;
+	}
+	spin_unlock(&io_lock);
+	tcb* t;
+	while ((t = queue_pop(&due)) != NULL)
+		mypthread_unpark(t);
+	return timeout;
+}
+
+// Register fd with epoll for what its waiters wait for, one shot. A fd
+// closed since it was last armed has dropped out of the epoll set on its
+// own, so MOD failing with ENOENT means ADD. io_fd_lock held.
+static int mypthread_io_arm(int fd) {
+	struct epoll_event ev = {0};
+	for (qnode_t* n = io_fds[fd].head; n != NULL; n = n->next)
+		ev.events |= n->data->io.events;
+	if (ev.events == 0) return 0;
+	ev.events |= EPOLLONESHOT;
+	ev.data.fd = fd;
+	if (epoll_ctl(io_epfd, EPOLL_CTL_MOD, fd, &ev) != 0 &&
+			(errno != ENOENT || epoll_ctl(io_epfd, EPOLL_CTL_ADD, fd, &ev) != 0))
+		return -1;
+	return 0;
+}
+
+// fd fired with `events`: wake the waiters it was for (all of them on an
+// error or hangup, their retry will see it) and re-arm for the rest
+static void mypthread_io_ready(int fd, uint events) {
+	queue_t due = {NULL, NULL, 0};
+	queue_t rest = {NULL, NULL, 0};
+	spin_lock(&io_fd_lock);
+	tcb* t;
+	while ((t = queue_pop(&io_fds[fd])) != NULL) {
+		if (t->io.events & events || events & (EPOLLERR | EPOLLHUP))
+			queue_push(&due, t);
+		else
+			queue_push(&rest, t);
+	}
+	io_fds[fd] = rest;
+	mypthread_io_arm(fd);
+	spin_unlock(&io_fd_lock);
+	atomic_fetch_sub(&io_waiters, due.size);
+	while ((t = queue_pop(&due)) != NULL)
+		mypthread_unpark(t);
+}
+
+// Wake sleepers and threads whose fd is ready, waiting up to timeout ms
+// (-1: until the next sleeper is due, or forever) for the first of them
+static void mypthread_io_poll(int timeout) {
+	int next = mypthread_wake_sleepers();
+	if (timeout < 0 || (next >= 0 && next < timeout))
+		timeout = next;
+	struct epoll_event ev[64];
+	int n = epoll_wait(io_epfd, ev, 64, timeout);
+	for (int i = 0; i < n; i++) {
+		if (ev[i].data.fd == io_wakefd) {
+			eventfd_t v;
+			eventfd_read(io_wakefd, &v);
+			continue;
+		}
+		mypthread_io_ready(ev[i].data.fd, ev[i].events);
+	}
+	if (timeout != 0)
+		mypthread_wake_sleepers();
+}
+
+// Anything queued on any worker? Only a hint, used by the poller after it
+// has announced itself so a concurrent mypthread_ready can't be missed
+static int mypthread_runnable(void) {
+	for (uint i = 0; i < mypthread_nworkers; i++) {
+		for (uint q = 0; q < MYPTHREAD_RQ_COUNT; q++)
+			if (!wsdeque_is_empty(&workers[i].rq[q])) return 1;
+		if (!queue_is_empty(&workers[i].inbox)) return 1;
+	}
+	return !queue_is_empty(overflow);
+}
+
+// Idle worker with threads waiting on I/O or sleeping: become the poller,
+// unless another worker already is. Returns 0 if we didn't poll.
+static int mypthread_io_idle(void) {
+	if (!mypthread_io_pending() || atomic_exchange(&io_poller, 1))
+		return 0;
+	atomic_store(&io_poller_blocked, 1);
+	atomic_thread_fence(memory_order_seq_cst); // pairs with mypthread_ready
+	mypthread_io_poll(mypthread_runnable() ? 0 : -1);
+	atomic_store(&io_poller_blocked, 0);
+	atomic_store(&io_poller, 0);
+	return 1;
+}
+
+// Park the running thread until fd is ready for `events`. Timer blocked.
+// Threads waiting on the same fd share its epoll entry, which waits for
+// everything any of them waits for.
+static int mypthread_io_wait(int fd, uint events) {
+	tcb* t = worker_self()->curr;
+	spin_lock(&io_fd_lock);
+	if ((uint)fd >= io_fd_cap) {
+		uint cap = io_fd_cap ? io_fd_cap : 64;
+		while (cap <= (uint)fd) cap *= 2;
+		queue_t* fds = realloc(io_fds, cap * sizeof(queue_t));
+		if (fds == NULL) {
+			spin_unlock(&io_fd_lock);
+			return -1;
+		}
+		memset(fds + io_fd_cap, 0, (cap - io_fd_cap) * sizeof(queue_t));
+		io_fds = fds;
+		io_fd_cap = cap;
+	}
+	t->io.events = events;
+	t->status = 1;
+	queue_push(&io_fds[fd], t);
+	atomic_fetch_add(&io_waiters, 1);
+	if (mypthread_io_arm(fd) != 0) {
+		int err = errno;
+		// we were pushed last, so we are the tail: drop it
+		queue_t keep = {NULL, NULL, 0};
+		tcb* w;
+		while ((w = queue_pop(&io_fds[fd])) != t)
+			queue_push(&keep, w);
+		io_fds[fd] = keep;
+		spin_unlock(&io_fd_lock);
+		atomic_fetch_sub(&io_waiters, 1);
+		t->status = 0;
+		errno = err;
+		return -1;
+	}
+	spin_unlock(&io_fd_lock);
+	schedule(SCHED_BLOCK);
+	return 0;
+}
+
+void* mypthread_io_thread(void* arg) {
+	while (1) {
+		while (sem_wait(&io_offload_sem) != 0);
+		spin_lock(&io_lock);
+		tcb* t = queue_pop(&io_offload);
+		spin_unlock(&io_lock);
+		if (t->io.op == IO_READ)
+			t->io.ret = read(t->io.fd, t->io.buf, t->io.count);
+		else
+			t->io.ret = write(t->io.fd, t->io.buf, t->io.count);
+		t->io.err = errno;
+		mypthread_unpark(t);
+	}
+	return NULL;
+}
+
+void mypthread_io_pool_start(void) {
+	for (uint i = 0; i < MYPTHREAD_IO_THREADS; i++) {
+		pthread_t kthread;
+		if (pthread_create(&kthread, NULL, mypthread_io_thread, NULL) != 0) {
+			perror("io thread create");
+			abort();
+		}
+		pthread_detach(kthread);
+	}
+}
+
+// Have the pool do a read or write that may block on the disk
+static ssize_t mypthread_io_offload(int op, int fd, void* buf, size_t count) {
+	pthread_once(&io_pool_once, mypthread_io_pool_start);
+	mypthread_timer_block();
+	tcb* t = worker_self()->curr;
+	t->io.op = op;
+	t->io.fd = fd;
+	t->io.buf = buf;
+	t->io.count = count;
+	t->status = 1;
+	spin_lock(&io_lock);
+	queue_push(&io_offload, t);
+	spin_unlock(&io_lock);
+	sem_post(&io_offload_sem);
+	schedule(SCHED_BLOCK);
+	errno = t->io.err;
+	return t->io.ret;
+}
+
+static int mypthread_is_file(int fd) {
+	struct stat st;
+	return fstat(fd, &st) == 0 && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode));
+}
+
+// A read or write that fails with EAGAIN rather than wait. RWF_NOWAIT
+// does that for this call only: O_NONBLOCK would stay on the open file
+// description, which other processes and plain read() calls share. Pipes
+// and sockets take it. Ttys don't, so they get O_NONBLOCK for the call and
+// their flags back after it.
+static ssize_t mypthread_io_nowait(int op, int fd, void* buf, size_t count) {
+	struct iovec iov = {buf, count};
+	ssize_t n = (op == IO_READ) ? preadv2(fd, &iov, 1, -1, RWF_NOWAIT) :
+		pwritev2(fd, &iov, 1, -1, RWF_NOWAIT);
+	if (n >= 0 || errno != EOPNOTSUPP) return n;
+
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0) return -1;
+	if (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+		return -1;
+	n = (op == IO_READ) ? read(fd, buf, count) : write(fd, buf, count);
+	if (!(flags & O_NONBLOCK)) {
+		int err = errno;
+		fcntl(fd, F_SETFL, flags);
+		errno = err;
+	}
+	return n;
+}
+
+// Shared by read and write: files first try RWF_NOWAIT, which only
+// succeeds from the page cache, then go to the pool. Everything else is
+// tried without waiting and, if it would block, waited on with epoll.
+static ssize_t mypthread_io(int op, int fd, void* buf, size_t count) {
+	mypthread_ensure_init();
+	mypthread_checkpoint();
+	ssize_t n;
+	if (mypthread_is_file(fd)) {
+		struct iovec iov = {buf, count};
+		n = (op == IO_READ) ? preadv2(fd, &iov, 1, -1, RWF_NOWAIT) :
+			pwritev2(fd, &iov, 1, -1, RWF_NOWAIT);
+		if (n >= 0 || (errno != EAGAIN && errno != EOPNOTSUPP))
+			return n;
+		return mypthread_io_offload(op, fd, buf, count);
+	}
+
+	while (1) {
+		n = mypthread_io_nowait(op, fd, buf, count);
+		if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return n;
+		mypthread_timer_block();
+		if (mypthread_io_wait(fd, op == IO_READ ? EPOLLIN : EPOLLOUT) != 0) {
+			int err = errno;
+			mypthread_timer_unblock();
+			errno = err;
+			return -1;
+		}
+	}
+}
+
+ssize_t mypthread_read(int fd, void *buf, size_t count) {
+	return mypthread_io(IO_READ, fd, buf, count);
+}
+
+ssize_t mypthread_write(int fd, const void *buf, size_t count) {
+	return mypthread_io(IO_WRITE, fd, (void*)buf, count);
+}
+
+// Park the running thread for ns nanoseconds. -1 with errno set if it
+// can't be queued.
+static int mypthread_sleep_ns(long ns) {
+	mypthread_ensure_init();
+	mypthread_timer_block();
+	tcb* t = worker_self()->curr;
+	t->io.wake_ns = mypthread_clock_ns() + ns;
+	spin_lock(&io_lock);
+	if (sleep_count == sleep_cap) {
+		uint cap = sleep_cap ? sleep_cap * 2 : 64;
+		tcb** heap = realloc(sleep_heap, cap * sizeof(tcb*));
+		if (heap == NULL) {
+			spin_unlock(&io_lock);
+			mypthread_timer_unblock();
+			errno = ENOMEM;
+			return -1;
+		}
+		sleep_heap = heap;
+		sleep_cap = cap;
+	}
+	t->status = 1;
+	sleep_heap_push(t);
+	atomic_store(&io_sleepers, sleep_count);
+	int first = sleep_heap[0] == t;
+	spin_unlock(&io_lock);
+	// the poller's epoll_wait timeout may be too long for us now
+	if (first && atomic_load(&io_poller_blocked))
+		eventfd_write(io_wakefd, 1);
+	schedule(SCHED_BLOCK);
+	return 0;
+}
+
+int mypthread_usleep(useconds_t usec) {
+	return mypthread_sleep_ns(usec * 1000L);
+}
+
+// Like sleep(3), the seconds left: all of them if we couldn't sleep
+unsigned int mypthread_sleep(unsigned int seconds) {
+	return mypthread_sleep_ns(seconds * 1000000000L) == 0 ? 0 : seconds;
+}
+
+// Switch to `to` once whichever worker last ran it has finished saving it
+void mypthread_resume(worker_t* w, tcb* to) {
+	int spins = 0;
+	while (atomic_load_explicit(&to->on_cpu, memory_order_acquire)) {
+		if (++spins % 128 == 0)
+			sched_yield();
+	}
+	atomic_store_explicit(&to->on_cpu, 1, memory_order_relaxed);
+	w->curr = to;
+	atomic_fetch_add(&w->nswitch, 1);
+}
+
+// Per-worker schedule() loop, entered with the timer blocked. Runs whenever
+// the worker has nothing else to do.
+void mypthread_worker_loop(void) {
+	worker_t* w = worker_self();
+	while (1) {
+		mypthread_switch_finish();
+		mypthread_timer_block();
+		tcb* tcb_next = sched_pick(w);
+		if (tcb_next == NULL && mypthread_io_idle())
+			continue;
+		if (tcb_next == NULL) {
+			// announce ourselves first so a concurrent push can't be missed
+			atomic_fetch_add(&idle_workers, 1);
+			atomic_thread_fence(memory_order_seq_cst);
+			tcb_next = sched_pick(w);
+			if (tcb_next == NULL)
+				while (sem_wait(&idle_sem) != 0);
+			atomic_fetch_sub(&idle_workers, 1);
+			if (tcb_next == NULL)
+				continue;
+		}
+		debug("worker %d picks up thread %d\n", w->id, tcb_next->tid);
+		mypthread_resume(w, tcb_next);
+		mypthread_account(w, NULL, tcb_next, SCHED_FROM_IDLE);
+		w->cpu_stamp = mypthread_cpu_ns(); // idle time is nobody's
+#ifdef MYPTHREAD_FAST_SWITCH
+		mypthread_switch_stack(&w->idle_sp, tcb_next->sp);
+#else
+		swapcontext(&w->idle_context, &tcb_next->context);
+#endif
+		// back here: that thread blocked or exited with nothing else to run
+	}
+}
+
+void* mypthread_worker_start(void* arg) {
+	worker_t* w = (worker_t*)arg;
+	worker_curr = w;
+	w->ktid = syscall(SYS_gettid);
+	w->active = &w->rq[0];
+	w->expired = &w->rq[1];
+	mypthread_timer_start(w);
+	mypthread_worker_loop();
+	return NULL;
+}
+
+// MYPTHREAD_WORKERS picks the number of kernel threads; unset keeps the
+// original single one, 0 means one per online cpu
+uint mypthread_worker_count(void) {
+	char* env = getenv("MYPTHREAD_WORKERS");
+	if (env == NULL) return 1;
+	long n = atol(env);
+	if (n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) n = 1;
+	if (n > MYPTHREAD_MAX_WORKERS) n = MYPTHREAD_MAX_WORKERS;
+	return n;
+}
+
+// Basic thread init function
+void mypthread_init(void) {
+	overflow = (queue_t*)calloc(1, sizeof(queue_t));
+	tcb_pool = (queue_t*)calloc(1, sizeof(queue_t));
+	tcb_reap = (queue_t*)calloc(1, sizeof(queue_t));
+	sem_init(&idle_sem, 0, 0);
+
+	mypthread_nworkers = mypthread_worker_count();
+	workers = (worker_t*)calloc(mypthread_nworkers, sizeof(worker_t));
+	if (workers == NULL) {
+		perror("worker mem");
+		abort();
+	}
+	for (uint i = 0; i < mypthread_nworkers; i++) {
+		for (uint q = 0; q < MYPTHREAD_MLFQ_LEVELS; q++) {
+			if (wsdeque_init(&workers[i].rq[q]) != 0) {
+				perror("run queue mem");
+				abort();
+			}
+		}
+	}
+
+	// the calling thread becomes tid 0, running on worker 0
+	tcb* tcb_main = calloc(1, sizeof(tcb));
+	tcb_main->status = 0; // 0 ready, -1 completed
+	tcb_main->age = 0;
+	tcb_main->on_cpu = 1;
+	tcb_main->stamp = mypthread_clock_ns();
+	tid_alloc(tcb_main); // tid 0
+	mypthread_live = 1;
+
+	worker_t* w = &workers[0];
+	w->ktid = syscall(SYS_gettid);
+	w->curr = tcb_main;
+	w->active = &w->rq[0];
+	w->expired = &w->rq[1];
+	worker_curr = w;
+
+	// worker 0 is running main on its own stack, so its loop needs one
+	w->idle_stack = malloc(MYPTHREAD_IDLE_STACK_SIZE);
+	if (w->idle_stack == NULL) {
+		perror("idle stack mem");
+		abort();
+	}
+	mypthread_context_make(&w->idle_sp, &w->idle_context, w->idle_stack,
+		MYPTHREAD_IDLE_STACK_SIZE, mypthread_worker_loop);
+
+	mypthread_trace_init();
+	mypthread_io_init();
+	mypthread_timer_init();
+
+	// the other workers sit in their loop on their own kernel stacks
+	for (uint i = 1; i < mypthread_nworkers; i++) {
+		pthread_t kthread;
+		workers[i].id = i;
+		if (pthread_create(&kthread, NULL, mypthread_worker_start, &workers[i]) != 0) {
+			perror("worker create");
+			abort();
+		}
+		pthread_detach(kthread);
+	}
+}
+
+// We need this function wrapper so we have a way to guarantee exiting at the end of a
+// function's runtime
+void mypthread_func_wrapper(void) {
+	// first run: finish the switch that brought us here
+	tcb* tcb_now = worker_self()->curr;
+	mypthread_switch_finish();
+	void *retval = tcb_now->func(tcb_now->arg);
+	mypthread_exit(retval);
+}
+
+// ** STACK AND TCB POOL **
+// Stacks are mmap'ed with a guard page underneath. MAP_NORESERVE only
+// reserves address space: pages are committed as the thread touches them.
+// Joined and exited detached tcbs go back on tcb_pool with their stack
+// still attached; all but the first few give their stack pages back, so
+// the pool pins address space but not memory.
+//
+// A PROT_NONE guard is a mapping of its own, two entries against
+// vm.max_map_count per stack. MADV_GUARD_INSTALL (Linux 6.13) marks the
+// page in the page tables instead, so the kernel merges neighbouring
+// stacks into one mapping, guards and all. Older kernels say EINVAL and
+// get the mprotect.
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#endif
+
+void* mypthread_stack_map(size_t size, size_t guard) {
+	char* base = mmap(NULL, size + guard, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if (base == MAP_FAILED) return NULL;
+	if (guard > 0 && madvise(base, guard, MADV_GUARD_INSTALL) != 0 &&
+			mprotect(base, guard, PROT_NONE) != 0) {
+		munmap(base, size + guard);
+		return NULL;
+	}
+	return base + guard;
+}
+
+void mypthread_stack_unmap(void* stack, size_t size, size_t guard) {
+	munmap((char*)stack - guard, size + guard);
+}
+
+// Free what didn't fit in the pool. Not on the switch path: malloc's locks
+// may be held by the thread that was interrupted there.
+static void mypthread_tcb_reap(void) {
+	if (queue_is_empty(tcb_reap)) return;
+	mypthread_timer_block();
+	sched_lock_acquire();
+	queue_t reap = *tcb_reap;
+	tcb_reap->head = tcb_reap->tail = NULL;
+	tcb_reap->size = 0;
+	sched_lock_release();
+	mypthread_timer_unblock();
+	tcb* t;
+	while ((t = queue_pop(&reap)) != NULL) {
+		if (t->stack != NULL) // main's tcb has no stack of ours
+			mypthread_stack_unmap(t->stack, t->stack_size, t->guard_size);
+		free(t->specific);
+		free(t);
+	}
+}
+
+// A zeroed tcb with a stack of the given size, off the pool when possible
+tcb* mypthread_tcb_alloc(size_t stack_size, size_t guard_size) {
+	mypthread_tcb_reap();
+	// preempted holding the lock, we would have every worker spinning on it
+	mypthread_timer_block();
+	sched_lock_acquire();
+	tcb* t = queue_pop(tcb_pool);
+	sched_lock_release();
+	mypthread_timer_unblock();
+	if (t != NULL) {
+		void* stack = t->stack;
+		if (t->stack_size != stack_size || t->guard_size != guard_size) {
+			mypthread_stack_unmap(stack, t->stack_size, t->guard_size);
+			stack = mypthread_stack_map(stack_size, guard_size);
+		}
+		struct mypthread_specific* specific = t->specific;
+		uint nspecific = t->nspecific;
+		memset(t, 0, sizeof(tcb));
+		memset(specific, 0, nspecific * sizeof(*specific));
+		t->stack = stack;
+		t->specific = specific;
+		t->nspecific = nspecific;
+	} else {
+		t = calloc(1, sizeof(tcb));
+		if (t == NULL) return NULL;
+		t->stack = mypthread_stack_map(stack_size, guard_size);
+	}
+	t->stack_size = stack_size;
+	t->guard_size = guard_size;
+	if (t->stack == NULL) {
+		free(t->specific);
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+// Give back the tcb of a thread that has finished switching out for good.
+// Only syscalls, no free: exited detached threads come here from the switch.
+void mypthread_tcb_free(tcb* t) {
+	// the pool size is only a hint here, but the stack is still ours alone
+	uint pooled = tcb_pool->size;
+	if (t->stack != NULL && pooled >= MYPTHREAD_POOL_WARM && pooled < MYPTHREAD_POOL_MAX)
+		madvise(t->stack, t->stack_size, MADV_DONTNEED);
+	sched_lock_acquire();
+	if (t->stack != NULL && tcb_pool->size < MYPTHREAD_POOL_MAX)
+		queue_push(tcb_pool, t);
+	else
+		queue_push(tcb_reap, t);
+	sched_lock_release();
+}
+
+// Read what we honour out of a pthread attr. Sizes are rounded up to whole
+// pages; a guard size of 0 lets neighbouring stacks merge into one mapping
+// even on kernels without MADV_GUARD_INSTALL.
+static void mypthread_attr_apply(const pthread_attr_t* attr, tcb* t,
+		size_t* stack_size, size_t* guard_size) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	*stack_size = MYPTHREAD_STACK_SIZE;
+	*guard_size = page;
+	if (attr == NULL) return;
+
+	int state;
+	if (pthread_attr_getdetachstate(attr, &state) == 0)
+		t->detached = (state == PTHREAD_CREATE_DETACHED);
+
+	size_t size;
+	if (pthread_attr_getstacksize(attr, &size) == 0 && size > 0)
+		*stack_size = (size + page - 1) & ~(page - 1);
+	if (pthread_attr_getguardsize(attr, &size) == 0)
+		*guard_size = (size + page - 1) & ~(page - 1);
+
+	int policy;
+	struct sched_param param;
+	if (pthread_attr_getschedpolicy(attr, &policy) == 0 &&
+			(policy == SCHED_FIFO || policy == SCHED_RR) &&
+			pthread_attr_getschedparam(attr, &param) == 0 && param.sched_priority > 0)
+		t->prio = param.sched_priority;
+
+	cpu_set_t set;
+	if (pthread_attr_getaffinity_np(attr, sizeof(set), &set) == 0) {
+		for (uint i = 0; i < mypthread_nworkers; i++)
+			if (CPU_ISSET(i, &set))
+				t->affinity |= 1UL << i;
+		if (t->affinity == (1UL << (mypthread_nworkers - 1) << 1) - 1)
+			t->affinity = 0; // every worker, same as none
+	}
+}
+
+/* create a new thread */
+static void mypthread_ensure_init(void) {
+	if (mypthread_init_flag) {
+		mypthread_init_flag = 0;
+		mypthread_init();
+	}
+}
+
+int mypthread_create(mypthread_t * thread, pthread_attr_t * attr,
+                      void *(*function)(void*), void * arg) {
+	mypthread_ensure_init();
+
+	// create & init tcb for new thread
+	tcb attrs = {0};
+	size_t stack_size, guard_size;
+	mypthread_attr_apply(attr, &attrs, &stack_size, &guard_size);
+	tcb* tcb_new = mypthread_tcb_alloc(stack_size, guard_size);
+	if (tcb_new == NULL) return EAGAIN; // out of memory or mappings
+	tcb_new->detached = attrs.detached;
+	tcb_new->prio = attrs.prio;
+	tcb_new->credit = attrs.prio;
+	tcb_new->affinity = attrs.affinity;
+	tcb_new->status = 0;  // 0 ready, -1 completed
+	tcb_new->age = 0;
+	tcb_new->func = function;
+	tcb_new->arg = arg;
+	// create * init conext for new thread
+	mypthread_context_make(&tcb_new->sp, &tcb_new->context, tcb_new->stack,
+		tcb_new->stack_size, mypthread_func_wrapper);
+	// starts inside a switch, the wrapper unblocks once it holds no locks
+	tcb_new->preempt_off = 1;
+	tcb_new->stamp = mypthread_clock_ns();
+
+	// add new thread to the run queue
+	mypthread_timer_block();
+	sched_lock_acquire();
+	if (tid_alloc(tcb_new) != 0) {
+		sched_lock_release();
+		mypthread_tcb_free(tcb_new);
+		mypthread_timer_unblock();
+		return EAGAIN;
+	}
+	sched_lock_release();
+	atomic_fetch_add(&mypthread_live, 1);
+	*thread = tcb_new->tid;
+	// new threads have used no cpu yet, so STCF runs them this round
+  	mypthread_ready(tcb_new, 0);
+	debug("create thread: %d\n", tcb_new->tid);
+
+	mypthread_timer_unblock();
+  	return 0;
+};
+
+/* give CPU possession to other user-level threads voluntarily */
+int mypthread_yield() {
+  	mypthread_timer_block();
+	schedule(SCHED_YIELD);
+	return 0;
+};
+
+/* coop mode safepoint: take the tick the watchdog left us, if any */
+void mypthread_checkpoint(void) {
+	worker_t* w = worker_self();
+	if (w == NULL || !atomic_load_explicit(&w->should_yield, memory_order_relaxed))
+		return;
+	mypthread_timer_block();
+	w = worker_self(); // pinned now
+	if (w->curr != NULL && atomic_exchange(&w->should_yield, 0))
+		schedule(SCHED_TIMER);
+	else
+		mypthread_timer_unblock();
+};
+
+/* terminate a thread */
+static void mypthread_key_destruct(tcb* t);
+
+void mypthread_exit(void *value_ptr) {
+	mypthread_key_destruct(mypthread_current());
+	// mark current thread as completed
+  	mypthread_timer_block();
+	tcb* tcb_curr = worker_self()->curr; // timer blocked, we cannot move
+	debug("exit thread %d\n", tcb_curr->tid);
+	// status goes to -1 once we are off the cpu, see mypthread_switch_finish
+	tcb_curr->retval = value_ptr;
+	if (atomic_fetch_sub(&mypthread_live, 1) == 1) {
+	// last thread, terminate the process
+		exit(0);
+	}
+	schedule(SCHED_EXIT);
+};
+
+
+/* Wait for thread termination */
+int mypthread_join(mypthread_t thread, void **value_ptr) {
+	mypthread_timer_block();
+	tcb* tcb_curr = worker_self()->curr;
+	sched_lock_acquire();
+	tcb* tcb_found = tid_lookup(thread);
+	if (tcb_found == NULL || tcb_found == tcb_curr || tcb_found->detached) {
+		sched_lock_release();
+		mypthread_timer_unblock();
+		return tcb_found == NULL ? ESRCH : tcb_found == tcb_curr ? EDEADLK : EINVAL;
+	}
+	if (tcb_found->status != -1) {
+		// park until its exit has switched it out, we get woken exactly once
+		tcb_curr->status = 1;
+		queue_push(&tcb_found->joiners, tcb_curr);
+		sched_lock_release();
+		schedule(SCHED_BLOCK);
+		mypthread_timer_block();
+		sched_lock_acquire();
+		if (tid_lookup(thread) != tcb_found) {
+			// another joiner got there first
+			sched_lock_release();
+			mypthread_timer_unblock();
+			return ESRCH;
+		}
+	}
+	tid_release(thread);
+	sched_lock_release();
+
+	debug("join found thread %d\n", tcb_found->tid);
+	if (value_ptr != NULL)
+		*value_ptr = tcb_found->retval;
+	mypthread_tcb_free(tcb_found);
+	mypthread_timer_unblock();
+	return 0;
+};
+
+// ** THREAD-SPECIFIC DATA **
+// A key is an index into every thread's specific array. Its seq is odd
+// while the key exists and bumped on create and delete, so values set
+// under an older incarnation of the index read back as NULL.
+
+struct mypthread_key {
+	atomic_uint seq;
+	void (*destructor)(void*);
+} mypthread_keys[MYPTHREAD_KEYS_MAX];
+
+int mypthread_key_create(mypthread_key_t *key, void (*destructor)(void*)) {
+	for (uint i = 0; i < MYPTHREAD_KEYS_MAX; i++) {
+		uint seq = atomic_load(&mypthread_keys[i].seq);
+		if ((seq & 1) == 0 &&
+				atomic_compare_exchange_strong(&mypthread_keys[i].seq, &seq, seq + 1)) {
+			mypthread_keys[i].destructor = destructor;
+			*key = i;
+			return 0;
+		}
+	}
+	return EAGAIN;
+}
+
+int mypthread_key_delete(mypthread_key_t key) {
+	if (key >= MYPTHREAD_KEYS_MAX) return EINVAL;
+	uint seq = atomic_load(&mypthread_keys[key].seq);
+	if ((seq & 1) == 0 ||
+			!atomic_compare_exchange_strong(&mypthread_keys[key].seq, &seq, seq + 1))
+		return EINVAL;
+	return 0;
+}
+
+void *mypthread_getspecific(mypthread_key_t key) {
+	mypthread_ensure_init();
+	tcb* t = mypthread_current();
+	if (key >= t->nspecific) return NULL;
+	struct mypthread_specific* s = &t->specific[key];
+	if (s->seq != atomic_load_explicit(&mypthread_keys[key].seq, memory_order_relaxed))
+		return NULL;
+	return s->data;
+}
+
+int mypthread_setspecific(mypthread_key_t key, const void *value) {
+	if (key >= MYPTHREAD_KEYS_MAX) return EINVAL;
+	uint seq = atomic_load_explicit(&mypthread_keys[key].seq, memory_order_relaxed);
+	if ((seq & 1) == 0) return EINVAL;
+	mypthread_ensure_init();
+	mypthread_timer_block(); // no switching out in the middle of malloc
+	tcb* t = worker_self()->curr;
+	if (key >= t->nspecific) {
+		// whole cache lines, so the array shares none with other threads
+		uint per_line = 64 / sizeof(struct mypthread_specific);
+		uint n = (key / per_line + 1) * per_line;
+		struct mypthread_specific* s = aligned_alloc(64, n * sizeof(*s));
+		if (s == NULL) {
+			mypthread_timer_unblock();
+			return ENOMEM;
+		}
+		memcpy(s, t->specific, t->nspecific * sizeof(*s));
+		memset(s + t->nspecific, 0, (n - t->nspecific) * sizeof(*s));
+		free(t->specific);
+		t->specific = s;
+		t->nspecific = n;
+	}
+	t->specific[key].seq = seq;
+	t->specific[key].data = (void*)value;
+	mypthread_timer_unblock();
+	return 0;
+}
+
+// Run the destructors of t's live, non-NULL values; they may set new ones
+static void mypthread_key_destruct(tcb* t) {
+	for (uint round = 0; round < MYPTHREAD_KEY_ROUNDS; round++) {
+		int called = 0;
+		for (uint i = 0; i < t->nspecific; i++) {
+			struct mypthread_specific* s = &t->specific[i];
+			void (*destructor)(void*) = mypthread_keys[i].destructor;
+			if (s->data == NULL || destructor == NULL ||
+					s->seq != atomic_load(&mypthread_keys[i].seq))
+				continue;
+			void* data = s->data;
+			s->data = NULL;
+			destructor(data);
+			called = 1;
+		}
+		if (!called) break;
+	}
+}
+
+/* Let the thread be reclaimed as soon as it exits, without a join */
+int mypthread_detach(mypthread_t thread) {
+	mypthread_timer_block();
+	sched_lock_acquire();
+	tcb* t = tid_lookup(thread);
+	if (t == NULL || t->detached) {
+		sched_lock_release();
+		mypthread_timer_unblock();
+		return t == NULL ? ESRCH : EINVAL;
+	}
+	t->detached = 1;
+	if (t->status == -1) {
+		// already gone, finishing its exit didn't see the flag
+		tid_release(thread);
+		sched_lock_release();
+		mypthread_tcb_free(t);
+	} else {
+		sched_lock_release();
+	}
+	mypthread_timer_unblock();
+	return 0;
+}
+
+/* initialize the mutex lock */
+int mypthread_mutex_init(mypthread_mutex_t *mutex,
+                          const pthread_mutexattr_t *mutexattr) {
+	atomic_init(&mutex->state, 0);
+	atomic_flag_clear(&mutex->guard);
+	mutex->owner = NULL;
+	mutex->lent_to = NULL;
+	mutex->spins = 0;
+	mutex->handoff = 0;
+	mutex->blocked = (queue_t){NULL, NULL, 0};
+	mutex->status = 1; // 1 - initialized
+	return 0;
+};
+
+// Spin a while on a contended mutex in case the owner, running on another
+// worker, lets go soon. The cap adapts like glibc's adaptive mutexes: about
+// twice what recent successful spins needed. Pointless with one worker,
+// the owner can't run while we spin.
+static int mypthread_mutex_spin(mypthread_mutex_t *mutex) {
+	if (mypthread_nworkers == 1) return 0;
+	int max = mutex->spins * 2 + 10;
+	if (max > MYPTHREAD_MUTEX_SPIN) max = MYPTHREAD_MUTEX_SPIN;
+	for (int i = 0; i < max; i++) {
+		int c = 0;
+		if (atomic_load_explicit(&mutex->state, memory_order_relaxed) == 0 &&
+				atomic_compare_exchange_weak_explicit(&mutex->state, &c, 1,
+					memory_order_acquire, memory_order_relaxed)) {
+			mutex->spins += (i - mutex->spins) / 8;
+			return 1;
+		}
+		cpu_relax();
+	}
+	mutex->spins += (max - mutex->spins) / 8;
+	return 0;
+}
+
+// Priority inheritance: a thread parking on a mutex lends the owner the best
+// priority among the waiters. Under STCF the owner stays in the current
+// round, under MLFQ it queues at the best waiter's level (see rq_push). The
+// loan takes effect when the owner is next queued, a deque can't give up a
+// thread from the middle. Each contended unlock pays back its mutex's loan,
+// and a thread keeps its best loan until it has paid back all of them.
+
+// With the guard held
+static void mypthread_mutex_lend(mypthread_mutex_t *mutex, tcb* owner) {
+	if (owner == NULL) return; // taken but owner not set yet
+	if (mutex->lent_to != owner) {
+		mutex->lent_to = owner;
+		atomic_fetch_add(&owner->pi_count, 1);
+	}
+#ifdef MLFQ
+	uint best = MYPTHREAD_MLFQ_LEVELS;
+	for (qnode_t* n = mutex->blocked.head; n != NULL; n = n->next)
+		if (mlfq_level(n->data) < best)
+			best = mlfq_level(n->data);
+	uint lent = atomic_load(&owner->pi_level);
+	while ((lent == 0 || best + 1 < lent) &&
+			!atomic_compare_exchange_weak(&owner->pi_level, &lent, best + 1))
+		;
+#endif
+}
+
+// With the guard held, as the owner lets go
+static void mypthread_mutex_repay(mypthread_mutex_t *mutex) {
+	tcb* t = mutex->lent_to;
+	if (t == NULL) return;
+	mutex->lent_to = NULL;
+	if (atomic_fetch_sub(&t->pi_count, 1) == 1)
+		atomic_store(&t->pi_level, 0);
+}
+
+/* aquire the mutex lock */
+// Waiters park FIFO on mutex->blocked. Normally unlock releases the mutex
+// and wakes the first waiter to compete for it, so a running thread can
+// take it again without a switch each time. A waiter that loses for longer
+// than MYPTHREAD_MUTEX_STARVE goes back to the head of the queue and turns
+// on handoff: unlock then passes ownership straight to the head waiter.
+// Handing off on every contended unlock instead makes each lock a switch:
+// vector_multiply, which locks once per element, went from 0.16 s to 16 s.
+int mypthread_mutex_lock(mypthread_mutex_t *mutex) {
+	if (mutex->status != 1) return EBUSY;
+	mypthread_checkpoint();
+	tcb* tcb_curr = mypthread_current();
+	if (mutex->owner == tcb_curr) return 0; // only thread owning the lock can change the owner
+	int c = 0;
+	if (!atomic_compare_exchange_strong_explicit(&mutex->state, &c, 1,
+			memory_order_acquire, memory_order_relaxed) &&
+			!mypthread_mutex_spin(mutex)) {
+		long since = 0; // when we first parked
+		mypthread_timer_block(); // critical section
+		spin_lock(&mutex->guard);
+		// Mark it contended, so whoever unlocks looks at the queue
+		while (atomic_exchange_explicit(&mutex->state, 2, memory_order_acquire) != 0) {
+			tcb_curr->status = 1;  // set tcb status as blocked
+			if (since == 0) {
+				since = mypthread_clock_ns();
+				queue_push(&mutex->blocked, tcb_curr);  // add it into per mutex blocked queue
+			} else {
+				if (mypthread_clock_ns() - since > MYPTHREAD_MUTEX_STARVE * 1000L)
+					mutex->handoff = 1;
+				queue_push_front(&mutex->blocked, tcb_curr); // keep our place
+			}
+			mypthread_mutex_lend(mutex, mutex->owner);
+			spin_unlock(&mutex->guard);
+			debug("thread %d failed to lock mutex and yield\n", tcb_curr->tid);
+			schedule(SCHED_BLOCK); // Yield to next
+			if (mutex->owner == tcb_curr) {
+				// handed over by unlock. Back to competing once waiters
+				// stop starving, or every lock would cost a switch
+				long waited = mypthread_clock_ns() - since;
+				tcb_curr->stats.mutex_wait_ns += waited;
+				if (waited < MYPTHREAD_MUTEX_STARVE * 1000L) {
+					mypthread_timer_block();
+					spin_lock(&mutex->guard);
+					mutex->handoff = 0;
+					spin_unlock(&mutex->guard);
+					mypthread_timer_unblock();
+				}
+				return 0;
+			}
+			mypthread_timer_block();
+			spin_lock(&mutex->guard);
+		}
+		spin_unlock(&mutex->guard);
+		if (since != 0)
+			tcb_curr->stats.mutex_wait_ns += mypthread_clock_ns() - since;
+		mypthread_timer_unblock();
+	}
+	// debug("thread %d locked mutex\n", tcb_curr->tid);
+	mutex->owner = tcb_curr;
+  	return 0;
+};
+
+static void mypthread_mutex_wake(mypthread_mutex_t *mutex);
+
+/* release the mutex lock */
+int mypthread_mutex_unlock(mypthread_mutex_t *mutex) {
+	if (mutex->owner != mypthread_current())
+		return EBUSY;
+	mutex->owner = NULL;
+	int c = 1;
+	if (!atomic_compare_exchange_strong_explicit(&mutex->state, &c, 0,
+			memory_order_release, memory_order_relaxed)) {
+		// somebody is waiting
+		mypthread_timer_block();
+		mypthread_mutex_wake(mutex);
+		mypthread_timer_unblock();
+	}
+	mypthread_checkpoint();
+	return 0;
+};
+
+// Contended unlock, with the timer blocked and owner already cleared
+static void mypthread_mutex_wake(mypthread_mutex_t *mutex) {
+	spin_lock(&mutex->guard);
+	mypthread_mutex_repay(mutex);
+	tcb* tcb_blocked = queue_pop(&mutex->blocked);
+	if (tcb_blocked != NULL && mutex->handoff) {
+		// a waiter is starving: never release, it owns the mutex now
+		if (queue_is_empty(&mutex->blocked)) {
+			mutex->handoff = 0;
+			atomic_store_explicit(&mutex->state, 1, memory_order_relaxed);
+		}
+		mutex->owner = tcb_blocked;
+		if (!queue_is_empty(&mutex->blocked))
+			mypthread_mutex_lend(mutex, tcb_blocked);
+	} else {
+		// the woken waiter marks it contended again when it retries, so
+		// the rest of the queue is not forgotten
+		atomic_store_explicit(&mutex->state, 0, memory_order_release);
+	}
+	spin_unlock(&mutex->guard);
+	if (tcb_blocked != NULL) {
+		mypthread_unpark(tcb_blocked);
+		debug("Thread %d changed from blocked to ready\n", tcb_blocked->tid);
+	}
+}
+
+
+/* destroy the mutex */
+int mypthread_mutex_destroy(mypthread_mutex_t *mutex) {
+	if (mutex->status != 1) return EBUSY;
+	if (mypthread_current() != mutex->owner)
+		mypthread_mutex_lock(mutex); // wait out whoever holds it
+	mutex->status = 0;
+	mutex->owner = NULL;
+	atomic_store(&mutex->state, 0);
+	return 0;
+};
+
+/* initialize the condition variable */
+int mypthread_cond_init(mypthread_cond_t *cond, const pthread_condattr_t *condattr) {
+	atomic_flag_clear(&cond->guard);
+	cond->waiters = (queue_t){NULL, NULL, 0};
+	cond->status = 1;
+	return 0;
+};
+
+/* wait on the condition variable, with the mutex held */
+int mypthread_cond_wait(mypthread_cond_t *cond, mypthread_mutex_t *mutex) {
+	if (cond->status != 1) return EINVAL;
+	mypthread_timer_block();
+	tcb* tcb_curr = worker_self()->curr;
+	if (mutex->owner != tcb_curr) {
+		mypthread_timer_unblock();
+		return EPERM;
+	}
+	// Queue up before letting go of the mutex, so a signal sent as soon
+	// as it is free can't be missed
+	spin_lock(&cond->guard);
+	tcb_curr->status = 1;
+	queue_push(&cond->waiters, tcb_curr);
+	spin_unlock(&cond->guard);
+	mutex->owner = NULL;
+	int c = 1;
+	if (!atomic_compare_exchange_strong_explicit(&mutex->state, &c, 0,
+			memory_order_release, memory_order_relaxed))
+		mypthread_mutex_wake(mutex);
+	schedule(SCHED_BLOCK);
+	return mypthread_mutex_lock(mutex);
+};
+
+/* wake one thread waiting on the condition variable */
+int mypthread_cond_signal(mypthread_cond_t *cond) {
+	if (cond->status != 1) return EINVAL;
+	mypthread_timer_block();
+	spin_lock(&cond->guard);
+	tcb* t = queue_pop(&cond->waiters);
+	spin_unlock(&cond->guard);
+	if (t != NULL)
+		mypthread_unpark(t);
+	mypthread_timer_unblock();
+	return 0;
+};
+
+/* wake every thread waiting on the condition variable */
+int mypthread_cond_broadcast(mypthread_cond_t *cond) {
+	if (cond->status != 1) return EINVAL;
+	mypthread_timer_block();
+	spin_lock(&cond->guard);
+	queue_t waiters = cond->waiters;
+	cond->waiters = (queue_t){NULL, NULL, 0};
+	spin_unlock(&cond->guard);
+	tcb* t;
+	while ((t = queue_pop(&waiters)) != NULL)
+		mypthread_unpark(t);
+	mypthread_timer_unblock();
+	return 0;
+};
+
+/* destroy the condition variable */
+int mypthread_cond_destroy(mypthread_cond_t *cond) {
+	if (cond->status != 1) return EINVAL;
+	if (!queue_is_empty(&cond->waiters)) return EBUSY;
+	cond->status = 0;
+	return 0;
+};
+
+/* initialize the read-write lock */
+int mypthread_rwlock_init(mypthread_rwlock_t *rwlock,
+                          const pthread_rwlockattr_t *rwlockattr) {
+	int kind = PTHREAD_RWLOCK_PREFER_READER_NP;
+	if (rwlockattr != NULL)
+		pthread_rwlockattr_getkind_np(rwlockattr, &kind);
+	rwlock->prefer_writer = (kind != PTHREAD_RWLOCK_PREFER_READER_NP);
+	atomic_flag_clear(&rwlock->guard);
+	rwlock->readers = 0;
+	rwlock->writer = -1;
+	rwlock->readq = (queue_t){NULL, NULL, 0};
+	rwlock->writeq = (queue_t){NULL, NULL, 0};
+	rwlock->status = 1;
+	return 0;
+};
+
+// Can a new reader get in right now? Writer-preferring locks hold new
+// readers back while a writer waits, so writers can't starve.
+static int mypthread_rwlock_readable(mypthread_rwlock_t *rwlock) {
+	return rwlock->writer == (uint)-1 &&
+		(!rwlock->prefer_writer || queue_is_empty(&rwlock->writeq));
+}
+
+/* aquire the read-write lock for reading */
+int mypthread_rwlock_rdlock(mypthread_rwlock_t *rwlock) {
+	if (rwlock->status != 1) return EINVAL;
+	mypthread_timer_block();
+	spin_lock(&rwlock->guard);
+	if (mypthread_rwlock_readable(rwlock)) {
+		rwlock->readers++;
+		spin_unlock(&rwlock->guard);
+		mypthread_timer_unblock();
+	} else {
+		// whoever wakes us has counted us in already
+		mypthread_park(&rwlock->readq, &rwlock->guard);
+	}
+	return 0;
+};
+
+int mypthread_rwlock_tryrdlock(mypthread_rwlock_t *rwlock) {
+	if (rwlock->status != 1) return EINVAL;
+	int ret = EBUSY;
+	mypthread_timer_block();
+	spin_lock(&rwlock->guard);
+	if (mypthread_rwlock_readable(rwlock)) {
+		rwlock->readers++;
+		ret = 0;
+	}
+	spin_unlock(&rwlock->guard);
+	mypthread_timer_unblock();
+	return ret;
+};
+
+/* aquire the read-write lock for writing */
+int mypthread_rwlock_wrlock(mypthread_rwlock_t *rwlock) {
+	if (rwlock->status != 1) return EINVAL;
+	mypthread_timer_block();
+	tcb* tcb_curr = worker_self()->curr;
+	spin_lock(&rwlock->guard);
+	if (rwlock->writer == tcb_curr->tid) {
+		spin_unlock(&rwlock->guard);
+		mypthread_timer_unblock();
+		return EDEADLK;
+	}
+	if (rwlock->writer == (uint)-1 && rwlock->readers == 0) {
+		rwlock->writer = tcb_curr->tid;
+		spin_unlock(&rwlock->guard);
+		mypthread_timer_unblock();
+	} else {
+		// whoever wakes us makes us the writer
+		mypthread_park(&rwlock->writeq, &rwlock->guard);
+	}
+	return 0;
+};
+
+int mypthread_rwlock_trywrlock(mypthread_rwlock_t *rwlock) {
+	if (rwlock->status != 1) return EINVAL;
+	int ret = EBUSY;
+	mypthread_timer_block();
+	tcb* tcb_curr = worker_self()->curr;
+	spin_lock(&rwlock->guard);
+	if (rwlock->writer == (uint)-1 && rwlock->readers == 0) {
+		rwlock->writer = tcb_curr->tid;
+		ret = 0;
+	}
+	spin_unlock(&rwlock->guard);
+	mypthread_timer_unblock();
+	return ret;
+};
+
+/* release the read-write lock */
+int mypthread_rwlock_unlock(mypthread_rwlock_t *rwlock) {
+	if (rwlock->status != 1) return EINVAL;
+	mypthread_timer_block();
+	tcb* tcb_curr = worker_self()->curr;
+	queue_t wake = {NULL, NULL, 0};
+	tcb* t;
+	spin_lock(&rwlock->guard);
+	if (rwlock->writer == tcb_curr->tid) {
+		rwlock->writer = -1;
+	} else if (rwlock->writer == (uint)-1 && rwlock->readers > 0) {
+		rwlock->readers--;
+	} else {
+		spin_unlock(&rwlock->guard);
+		mypthread_timer_unblock();
+		return EPERM;
+	}
+	if (rwlock->writer == (uint)-1 && rwlock->readers == 0) {
+		// Free: hand it over directly, either to the next writer or to
+		// every waiting reader at once
+		if (!queue_is_empty(&rwlock->writeq) &&
+				(rwlock->prefer_writer || queue_is_empty(&rwlock->readq))) {
+			t = queue_pop(&rwlock->writeq);
+			rwlock->writer = t->tid;
+			queue_push(&wake, t);
+		} else {
+			while ((t = queue_pop(&rwlock->readq)) != NULL) {
+				rwlock->readers++;
+				queue_push(&wake, t);
+			}
+		}
+	}
+	spin_unlock(&rwlock->guard);
+	while ((t = queue_pop(&wake)) != NULL)
+		mypthread_unpark(t);
+	mypthread_timer_unblock();
+	return 0;
+};
+
+/* destroy the read-write lock */
+int mypthread_rwlock_destroy(mypthread_rwlock_t *rwlock) {
+	if (rwlock->status != 1) return EINVAL;
+	if (rwlock->readers != 0 || rwlock->writer != (uint)-1) return EBUSY;
+	rwlock->status = 0;
+	return 0;
+};
+
+/* initialize the barrier */
+int mypthread_barrier_init(mypthread_barrier_t *barrier,
+                           const pthread_barrierattr_t *barrierattr, unsigned count) {
+	if (count == 0) return EINVAL;
+	atomic_flag_clear(&barrier->guard);
+	barrier->count = count;
+	barrier->arrived = 0;
+	barrier->waiters = (queue_t){NULL, NULL, 0};
+	barrier->status = 1;
+	return 0;
+};
+
+/* wait until count threads have reached the barrier */
+int mypthread_barrier_wait(mypthread_barrier_t *barrier) {
+	if (barrier->status != 1) return EINVAL;
+	mypthread_timer_block();
+	spin_lock(&barrier->guard);
+	if (++barrier->arrived < barrier->count) {
+		mypthread_park(&barrier->waiters, &barrier->guard);
+		return 0;
+	}
+	// last one in releases everybody and resets the barrier for reuse
+	barrier->arrived = 0;
+	queue_t waiters = barrier->waiters;
+	barrier->waiters = (queue_t){NULL, NULL, 0};
+	spin_unlock(&barrier->guard);
+	tcb* t;
+	while ((t = queue_pop(&waiters)) != NULL)
+		mypthread_unpark(t);
+	mypthread_timer_unblock();
+	return PTHREAD_BARRIER_SERIAL_THREAD;
+};
+
+/* destroy the barrier */
+int mypthread_barrier_destroy(mypthread_barrier_t *barrier) {
+	if (barrier->status != 1) return EINVAL;
+	if (barrier->arrived != 0) return EBUSY;
+	barrier->status = 0;
+	return 0;
+};
+
+// ** TASKS **
+// A task is a function and argument run to completion on whichever stack
+// picks it up, so spawning one costs a small record on a queue instead of a
+// thread with a stack and context. Runner threads, one per worker and created
+// on first use, take tasks off the queue. A thread in mypthread_task_sync
+// runs queued tasks itself rather than block, which also keeps a task that
+// syncs on its own children from tying up a runner while they wait in line.
+
+typedef struct mypthread_task {
+	void (*fn)(void*);
+	void* arg;
+	mypthread_task_group_t* group;
+	struct mypthread_task* next;
+} mypthread_task_t;
+
+atomic_flag task_lock = ATOMIC_FLAG_INIT; // protects the lists below
+mypthread_task_t* task_head = NULL; // FIFO of tasks not started yet
+mypthread_task_t* task_tail = NULL;
+mypthread_task_t* task_free = NULL; // finished records, reused by spawn
+queue_t task_idle = {NULL, NULL, 0}; // runners with nothing to do
+atomic_int task_started = 0; // 1 while runners are being created, then 2
+uint task_runners = 0;
+
+// Take the oldest task and run it, 0 when there was none
+static int mypthread_task_run_one(void) {
+	mypthread_timer_block();
+	spin_lock(&task_lock);
+	mypthread_task_t* task = task_head;
+	if (task != NULL && (task_head = task->next) == NULL)
+		task_tail = NULL;
+	spin_unlock(&task_lock);
+	mypthread_timer_unblock();
+	if (task == NULL) return 0;
+
+	task->fn(task->arg);
+	mypthread_task_group_t* group = task->group;
+	mypthread_timer_block();
+	spin_lock(&task_lock);
+	task->next = task_free;
+	task_free = task;
+	spin_unlock(&task_lock);
+	// the group holds a reference for its syncer, see mypthread_task_sync.
+	// Whoever drops the last one wakes it, after which the group may be gone
+	if (atomic_fetch_sub(&group->pending, 1) == 1)
+		mypthread_unpark(group->waiter);
+	mypthread_timer_unblock();
+	return 1;
+}
+
+static void* mypthread_task_runner(void* arg) {
+	while (1) {
+		mypthread_checkpoint();
+		if (mypthread_task_run_one()) continue;
+		mypthread_timer_block();
+		spin_lock(&task_lock);
+		if (task_head != NULL) {
+			spin_unlock(&task_lock);
+			mypthread_timer_unblock();
+			continue;
+		}
+		mypthread_park(&task_idle, &task_lock);
+	}
+	return NULL;
+}
+
+static void mypthread_task_start(void) {
+	if (atomic_load(&task_started) == 2) return;
+	mypthread_ensure_init();
+	int expected = 0;
+	if (!atomic_compare_exchange_strong(&task_started, &expected, 1)) {
+		while (atomic_load(&task_started) != 2)
+			mypthread_yield();
+		return;
+	}
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (uint i = 0; i < mypthread_nworkers; i++) {
+		mypthread_t runner;
+		if (mypthread_create(&runner, &attr, mypthread_task_runner, NULL) != 0)
+			break;
+		// runners never exit, they must not keep the process alive
+		atomic_fetch_sub(&mypthread_live, 1);
+		task_runners++;
+	}
+	pthread_attr_destroy(&attr);
+	atomic_store(&task_started, 2);
+}
+
+int mypthread_task_group_init(mypthread_task_group_t *group) {
+	atomic_init(&group->pending, 1);
+	group->waiter = NULL;
+	return 0;
+};
+
+/* queue fn(arg) as part of group */
+int mypthread_task_spawn(mypthread_task_group_t *group, void (*fn)(void*), void *arg) {
+	mypthread_task_start();
+	if (task_runners == 0) return EAGAIN;
+	mypthread_timer_block();
+	spin_lock(&task_lock);
+	mypthread_task_t* task = task_free;
+	if (task != NULL) task_free = task->next;
+	spin_unlock(&task_lock);
+	if (task == NULL && (task = malloc(sizeof(mypthread_task_t))) == NULL) {
+		mypthread_timer_unblock();
+		return ENOMEM;
+	}
+	task->fn = fn;
+	task->arg = arg;
+	task->group = group;
+	task->next = NULL;
+	atomic_fetch_add(&group->pending, 1);
+
+	spin_lock(&task_lock);
+	if (task_tail != NULL) task_tail->next = task;
+	else task_head = task;
+	task_tail = task;
+	tcb* runner = queue_pop(&task_idle);
+	spin_unlock(&task_lock);
+	if (runner != NULL)
+		mypthread_unpark(runner);
+	mypthread_timer_unblock();
+	return 0;
+};
+
+/* wait for every task spawned into group, running queued tasks meanwhile.
+ * One thread syncs a group at a time; it can be reused afterwards. */
+int mypthread_task_sync(mypthread_task_group_t *group) {
+	while (atomic_load(&group->pending) > 1 && mypthread_task_run_one())
+		;
+	mypthread_timer_block();
+	tcb* tcb_curr = worker_self()->curr;
+	group->waiter = tcb_curr;
+	tcb_curr->status = 1;
+	if (atomic_fetch_sub(&group->pending, 1) == 1) {
+		// everything had finished, nobody will wake us
+		tcb_curr->status = 0;
+		mypthread_timer_unblock();
+	} else {
+		schedule(SCHED_BLOCK);
+	}
+	atomic_store(&group->pending, 1);
+	return 0;
+};
+
+// A parallel_for does not queue a task per tile. It queues one claimer per
+// runner, and they and the caller take tiles off a shared counter until the
+// range is used up, so slow tiles just mean fewer tiles for that claimer.
+typedef struct mypthread_loop {
+	atomic_long next; // first iteration not claimed yet
+	long end;
+	long grain;
+	void (*body)(long, long, void*);
+	void* arg;
+} mypthread_loop_t;
+
+static void mypthread_loop_claim(void* arg) {
+	mypthread_loop_t* loop = (mypthread_loop_t*)arg;
+	long lo;
+	while ((lo = atomic_fetch_add(&loop->next, loop->grain)) < loop->end) {
+		loop->body(lo, lo + loop->grain < loop->end ? lo + loop->grain : loop->end,
+			loop->arg);
+		mypthread_checkpoint();
+	}
+}
+
+/* run body(lo, hi, arg) over tiles of [begin, end) */
+int mypthread_parallel_for(long begin, long end, long grain,
+                           void (*body)(long lo, long hi, void *arg), void *arg) {
+	if (end <= begin) return 0;
+	mypthread_task_start();
+	// by default aim for 8 tiles per participant, enough to even out the load
+	if (grain <= 0)
+		grain = (end - begin) / (8 * (task_runners + 1));
+	if (grain <= 0)
+		grain = 1;
+	mypthread_loop_t loop = {begin, end, grain, body, arg};
+	mypthread_task_group_t group;
+	mypthread_task_group_init(&group);
+	long tiles = (end - begin - 1) / grain + 1;
+	for (long i = 0; i < tiles - 1 && i < task_runners; i++)
+		if (mypthread_task_spawn(&group, mypthread_loop_claim, &loop) != 0)
+			break;
+	mypthread_loop_claim(&loop);
+	return mypthread_task_sync(&group);
+};
+
+// ** CHANNELS **
+// A bounded ring where every slot carries a sequence number saying whose
+// turn it is: seq == pos means free for the sender that claims position
+// pos, seq == pos + 1 means full for the receiver that claims it. Senders
+// and receivers claim positions with a CAS on their own counter, and a
+// batch claims a run of consecutive ready slots with one CAS. Only a full
+// or empty channel takes the guard, to park; the other side checks the
+// waiting count after every transfer and wakes as many as it made room for.
+
+// Claim up to max ready slots at *pos, where ready means seq == pos + lap.
+// Returns how many, the first position goes in *first.
+static size_t chan_claim(mypthread_chan_t* chan, atomic_ulong* pos, ulong lap,
+                         size_t max, ulong* first) {
+	ulong p = atomic_load_explicit(pos, memory_order_relaxed);
+	while (1) {
+		size_t n = 0;
+		while (n < max && atomic_load_explicit(&chan->slot[(p + n) & chan->mask].seq,
+				memory_order_acquire) == p + n + lap)
+			n++;
+		if (n == 0) {
+			// full or empty, unless somebody claimed p under us
+			ulong now = atomic_load_explicit(pos, memory_order_relaxed);
+			if (now == p) return 0;
+			p = now;
+		} else if (atomic_compare_exchange_weak_explicit(pos, &p, p + n,
+				memory_order_relaxed, memory_order_relaxed)) {
+			*first = p;
+			return n;
+		}
+	}
+}
+
+// Whether the next slot at *pos might be ready, re-checked before parking
+static int chan_ready(mypthread_chan_t* chan, atomic_ulong* pos, ulong lap) {
+	ulong p = atomic_load(pos);
+	ulong seq = atomic_load(&chan->slot[p & chan->mask].seq);
+	return (long)(seq - (p + lap)) >= 0;
+}
+
+// Wake up to n threads parked on q after making room or data for them
+static void chan_wake(mypthread_chan_t* chan, queue_t* q, atomic_uint* waiting, size_t n) {
+	atomic_thread_fence(memory_order_seq_cst); // pairs with chan_wait
+	if (atomic_load(waiting) == 0) return;
+	mypthread_timer_block();
+	queue_t wake = {NULL, NULL, 0};
+	tcb* t;
+	spin_lock(&chan->guard);
+	while (n-- > 0 && (t = queue_pop(q)) != NULL) {
+		atomic_fetch_sub(waiting, 1);
+		queue_push(&wake, t);
+	}
+	spin_unlock(&chan->guard);
+	while ((t = queue_pop(&wake)) != NULL)
+		mypthread_unpark(t);
+	mypthread_timer_unblock();
+}
+
+// Park on q unless the slot at *pos became ready or the channel closed
+// since we last looked. Whoever pops us takes us off the waiting count.
+static void chan_wait(mypthread_chan_t* chan, queue_t* q, atomic_uint* waiting,
+                      atomic_ulong* pos, ulong lap) {
+	mypthread_timer_block();
+	spin_lock(&chan->guard);
+	atomic_fetch_add(waiting, 1);
+	atomic_thread_fence(memory_order_seq_cst); // pairs with chan_wake
+	if (!chan_ready(chan, pos, lap) && !atomic_load(&chan->closed)) {
+		mypthread_park(q, &chan->guard);
+		return;
+	}
+	atomic_fetch_sub(waiting, 1);
+	spin_unlock(&chan->guard);
+	mypthread_timer_unblock();
+}
+
+// Move up to count items in without blocking
+static size_t chan_put(mypthread_chan_t* chan, void* const* items, size_t count) {
+	ulong first;
+	size_t n = chan_claim(chan, &chan->send_pos, 0, count, &first);
+	for (size_t i = 0; i < n; i++) {
+		struct mypthread_chan_slot* s = &chan->slot[(first + i) & chan->mask];
+		s->item = items[i];
+		atomic_store_explicit(&s->seq, first + i + 1, memory_order_release);
+	}
+	if (n > 0)
+		chan_wake(chan, &chan->recvq, &chan->recv_waiting, n);
+	return n;
+}
+
+// Move up to count items out without blocking
+static size_t chan_get(mypthread_chan_t* chan, void** items, size_t count) {
+	ulong first;
+	size_t n = chan_claim(chan, &chan->recv_pos, 1, count, &first);
+	for (size_t i = 0; i < n; i++) {
+		struct mypthread_chan_slot* s = &chan->slot[(first + i) & chan->mask];
+		items[i] = s->item;
+		atomic_store_explicit(&s->seq, first + i + chan->mask + 1, memory_order_release);
+	}
+	if (n > 0)
+		chan_wake(chan, &chan->sendq, &chan->send_waiting, n);
+	return n;
+}
+
+/* initialize a channel holding up to capacity items (rounded up to a power of 2) */
+int mypthread_chan_init(mypthread_chan_t *chan, size_t capacity) {
+	if (capacity == 0 || capacity > (1UL << 40)) return EINVAL;
+	mypthread_ensure_init();
+	size_t size = 2;
+	while (size < capacity)
+		size *= 2;
+	mypthread_timer_block();
+	chan->slot = malloc(size * sizeof(struct mypthread_chan_slot));
+	mypthread_timer_unblock();
+	if (chan->slot == NULL) return ENOMEM;
+	for (size_t i = 0; i < size; i++)
+		atomic_init(&chan->slot[i].seq, i);
+	chan->mask = size - 1;
+	atomic_init(&chan->send_pos, 0);
+	atomic_init(&chan->recv_pos, 0);
+	atomic_flag_clear(&chan->guard);
+	atomic_init(&chan->send_waiting, 0);
+	atomic_init(&chan->recv_waiting, 0);
+	chan->sendq = (queue_t){NULL, NULL, 0};
+	chan->recvq = (queue_t){NULL, NULL, 0};
+	atomic_init(&chan->closed, 0);
+	chan->status = 1;
+	return 0;
+};
+
+/* send all count items in order, blocking while the channel is full */
+int mypthread_chan_send_batch(mypthread_chan_t *chan, void *const *items, size_t count) {
+	if (chan->status != 1) return EINVAL;
+	size_t done = 0;
+	while (done < count) {
+		if (atomic_load(&chan->closed)) return EPIPE;
+		size_t n = chan_put(chan, items + done, count - done);
+		if (n == 0)
+			chan_wait(chan, &chan->sendq, &chan->send_waiting, &chan->send_pos, 0);
+		done += n;
+	}
+	return 0;
+};
+
+/* receive between 1 and count items, blocking while the channel is empty.
+ * EPIPE once it is closed and drained */
+int mypthread_chan_recv_batch(mypthread_chan_t *chan, void **items, size_t count,
+                              size_t *received) {
+	if (chan->status != 1 || count == 0) return EINVAL;
+	size_t n;
+	while ((n = chan_get(chan, items, count)) == 0) {
+		if (atomic_load(&chan->closed)) {
+			// a send may have slipped in before the close
+			if ((n = chan_get(chan, items, count)) > 0) break;
+			return EPIPE;
+		}
+		chan_wait(chan, &chan->recvq, &chan->recv_waiting, &chan->recv_pos, 1);
+	}
+	if (received != NULL)
+		*received = n;
+	return 0;
+};
+
+int mypthread_chan_send(mypthread_chan_t *chan, void *item) {
+	return mypthread_chan_send_batch(chan, &item, 1);
+};
+
+int mypthread_chan_recv(mypthread_chan_t *chan, void **item) {
+	return mypthread_chan_recv_batch(chan, item, 1, NULL);
+};
+
+int mypthread_chan_trysend(mypthread_chan_t *chan, void *item) {
+	if (chan->status != 1) return EINVAL;
+	if (atomic_load(&chan->closed)) return EPIPE;
+	return chan_put(chan, &item, 1) ? 0 : EAGAIN;
+};
+
+int mypthread_chan_tryrecv(mypthread_chan_t *chan, void **item) {
+	if (chan->status != 1) return EINVAL;
+	if (chan_get(chan, item, 1)) return 0;
+	if (!atomic_load(&chan->closed)) return EAGAIN;
+	return chan_get(chan, item, 1) ? 0 : EPIPE;
+};
+
+/* no more sends: wake everybody, receivers drain what is left */
+int mypthread_chan_close(mypthread_chan_t *chan) {
+	if (chan->status != 1) return EINVAL;
+	if (atomic_exchange(&chan->closed, 1)) return EPIPE;
+	chan_wake(chan, &chan->sendq, &chan->send_waiting, (size_t)-1);
+	chan_wake(chan, &chan->recvq, &chan->recv_waiting, (size_t)-1);
+	return 0;
+};
+
+/* destroy the channel, nobody may be blocked on it */
+int mypthread_chan_destroy(mypthread_chan_t *chan) {
+	if (chan->status != 1) return EINVAL;
+	if (atomic_load(&chan->send_waiting) || atomic_load(&chan->recv_waiting))
+		return EBUSY;
+	chan->status = 0;
+	mypthread_timer_block();
+	free(chan->slot);
+	mypthread_timer_unblock();
+	return 0;
+};
+
+// Switch this worker from one thread to the next, or to its idle loop when
+// there is none. Called with the timer blocked; the thread we leave is queued
+// by mypthread_switch_finish once its context has been saved.
+static void mypthread_context_switch(worker_t* w, tcb* from, tcb* to, int reason) {
+	w->prev = from;
+	w->prev_reason = reason;
+	if (to != NULL) {
+		mypthread_resume(w, to);
+		mypthread_account(w, from, to, reason);
+#ifdef MYPTHREAD_FAST_SWITCH
+		mypthread_switch_stack(&from->sp, to->sp);
+#else
+		swapcontext(&from->context, &to->context);
+#endif
+	} else {
+		w->curr = NULL;
+		atomic_fetch_add(&w->nswitch, 1);
+		mypthread_account(w, from, NULL, reason);
+#ifdef MYPTHREAD_FAST_SWITCH
+		mypthread_switch_stack(&from->sp, w->idle_sp);
+#else
+		swapcontext(&from->context, &w->idle_context);
+#endif
+	}
+	mypthread_switch_finish();
+}
+
+#ifndef MLFQ
+// STCF pick-next: each worker runs in rounds. New threads go on `active`,
+// anything that used up a quantum (or yielded) waits on `expired` until every
+// thread in the round has had one, which keeps the ages of runnable threads
+// within one quantum of each other the way the old sorted list did, in O(1).
+// A round is served oldest first like the old list, not from the owner's
+// LIFO end, or a thread that keeps yielding would be picked again ahead of
+// the ones that were waiting.
+static tcb* rq_pop(worker_t* w) {
+	tcb* t = wsdeque_take(w->active);
+	if (t != NULL) return t;
+
+	wsdeque_t* d = w->active;
+	w->active = w->expired;
+	w->expired = d;
+	if ((t = mypthread_take_overflow(w)) != NULL) return t;
+	return wsdeque_take(w->active);
+}
+#else
+// Put every thread queued on this worker back on level 0 once per boost
+// period, so cpu-bound threads sunk to the bottom can't starve
+static void mlfq_boost(worker_t* w) {
+	long ns = mypthread_clock_ns();
+	long next = atomic_load(&mlfq_next_boost);
+	if (ns >= next && atomic_compare_exchange_strong(&mlfq_next_boost, &next,
+			ns + MYPTHREAD_MLFQ_BOOST * 1000L))
+		atomic_fetch_add(&mlfq_epoch, 1);
+
+	// threads not queued here (running, blocked, elsewhere) get reset by
+	// rq_push when they next come back
+	uint epoch = atomic_load(&mlfq_epoch);
+	if (w->epoch == epoch) return;
+	w->epoch = epoch;
+	for (uint lvl = 1; lvl < MYPTHREAD_MLFQ_LEVELS; lvl++) {
+		tcb* t;
+		while ((t = wsdeque_take(&w->rq[lvl])) != NULL) {
+			// one demoted since the boost already has the new epoch, and
+			// rq_push would put it straight back on this level
+			t->epoch = epoch;
+			t->level = 0;
+			if (rq_push(w, t, 0) != 0) {
+				sched_lock_acquire();
+				queue_push(overflow, t);
+				sched_lock_release();
+			}
+		}
+	}
+	debug("worker %d boosted to epoch %d\n", w->id, epoch);
+}
+
+// MLFQ pick-next: head of the highest non-empty level, found with one ctz.
+// Thieves can empty a level behind our back, so a set bit is only a hint.
+static tcb* rq_pop(worker_t* w) {
+	mlfq_boost(w);
+	while (w->rq_bitmap != 0) {
+		uint lvl = __builtin_ctz(w->rq_bitmap);
+		tcb* t = wsdeque_take(&w->rq[lvl]);
+		if (t != NULL) return t;
+		w->rq_bitmap &= ~(1u << lvl);
+	}
+	return NULL;
+}
+#endif
+
+static tcb* sched_pick(worker_t* w) {
+	mypthread_take_inbox(w);
+	tcb* t = rq_pop(w);
+	if (t == NULL)
+		t = mypthread_take_overflow(w);
+	if (t == NULL)
+		t = mypthread_steal(w);
+	return t;
+}
+
+// Keep running the current thread after all
+static void sched_stay(tcb* tcb_saved, int reason) {
+	// debug("schedule stay on\n");
+	if (reason == SCHED_TIMER) {
+		mypthread_timer_reset(); // MLFQ may have changed our quantum
+		tcb_saved->stats.quanta++;
+	}
+	tcb_saved->preempt_pending = 0;
+	mypthread_timer_unblock();
+}
+
+// Common tail of both policies: switch to whatever sched_pick chooses
+static void sched_switch(worker_t* w, tcb* tcb_saved, int reason) {
+	tcb* tcb_next = sched_pick(w);
+	if (tcb_next == tcb_saved) {
+		// woken again before we even got off the cpu
+		tcb_saved->preempt_pending = 0;
+		mypthread_timer_unblock();
+		return;
+	}
+	if (tcb_next != NULL && atomic_load_explicit(&tcb_next->on_cpu, memory_order_acquire)) {
+		// Still switching out on another worker, which may be waiting in
+		// turn for tcb_saved: both would spin forever in mypthread_resume.
+		// Put it back and let go of tcb_saved, the idle loop can wait.
+		mypthread_ready(tcb_next, 0);
+		tcb_next = NULL;
+	}
+	if (tcb_next == NULL && (reason == SCHED_TIMER || reason == SCHED_YIELD)) {
+		sched_stay(tcb_saved, reason);
+		return;
+	}
+	debug("schedule from thread %d to thread %d\n", tcb_saved->tid, tcb_next ? (int)tcb_next->tid : -1);
+	mypthread_context_switch(w, tcb_saved, tcb_next, reason);
+}
+
+#ifndef MLFQ
+/* Preemptive SJF (STCF) scheduling algorithm */
+static void sched_stcf(int reason, int used) {
+	worker_t* w = worker_self();
+	tcb* tcb_saved = w->curr;
+	// Only a thread that has really used up a quantum of cpu is done with
+	// this round. One that blocked early is woken back into it, one that
+	// yielded early waits on expired but keeps the rest of its slice.
+	if (used) {
+		tcb_saved->age++;
+		tcb_saved->slice_ns = 0;
+	}
+	// a priority thread gets more quanta per round, back to back
+	if (reason == SCHED_TIMER && tcb_saved->credit > 0) {
+		tcb_saved->credit--;
+		sched_stay(tcb_saved, reason);
+		return;
+	}
+	if (reason != SCHED_BLOCK)
+		tcb_saved->credit = tcb_saved->prio;
+	sched_switch(w, tcb_saved, reason);
+}
+#endif
+
+#ifdef MLFQ
+/* Preemptive MLFQ scheduling algorithm */
+static void sched_mlfq(int reason, int used) {
+	worker_t* w = worker_self();
+	tcb* tcb_saved = w->curr;
+	if (used) {
+		// used its whole quantum: cpu-bound, demote it a level. The slice
+		// carries over yields and blocks, so giving up the cpu just before
+		// the timer fires doesn't keep a thread on top.
+		tcb_saved->age++;
+		tcb_saved->slice_ns = 0;
+		if (tcb_saved->epoch != atomic_load(&mlfq_epoch)) {
+			tcb_saved->epoch = atomic_load(&mlfq_epoch);
+			tcb_saved->level = 0;
+		}
+		// priority closes off the bottom levels, one per step
+		int floor = MYPTHREAD_MLFQ_LEVELS - 1 - tcb_saved->prio;
+		if ((int)tcb_saved->level < floor) {
+			tcb_saved->level++;
+			debug("thread %d demoted to level %d\n", tcb_saved->tid, tcb_saved->level);
+		}
+	}
+	// the timer only takes the cpu for a thread at the same level or above
+	if (reason == SCHED_TIMER) {
+		mlfq_boost(w);
+		if (tcb_saved->epoch != atomic_load(&mlfq_epoch)) {
+			tcb_saved->epoch = atomic_load(&mlfq_epoch);
+			tcb_saved->level = 0;
+		}
+		int waiting = !queue_is_empty(&w->inbox) || !queue_is_empty(overflow);
+		for (uint lvl = 0; lvl <= mlfq_level(tcb_saved); lvl++)
+			waiting |= !wsdeque_is_empty(&w->rq[lvl]);
+		if (!waiting) {
+			sched_stay(tcb_saved, reason);
+			return;
+		}
+	}
+	sched_switch(w, tcb_saved, reason);
+}
+#endif
+
+/* scheduler, entered with the timer blocked */
+static void schedule(int reason) {
 	// Every time when timer interrup happens, your thread library
 	// should be contexted switched from thread context to this
 	// schedule function
@@ -420,13 +2904,30 @@ static void schedule() {
 	// 		sched_mlfq();
 
 	// YOUR CODE HERE
+	worker_t* w = worker_self();
+	if (reason == SCHED_TIMER && mypthread_io_pending())
+		mypthread_io_poll(0); // the idle poller can't help while we are all busy
+	int used = mypthread_charge(w, w->curr);
+	if (reason == SCHED_TIMER) {
+		if (mypthread_timer_mode == TIMER_PROF) {
+			used = 1; // wall clock ticks, all we can go by
+		} else if (!used) {
+			// early tick, the timer was armed for a thread with less of
+			// its quantum left, see mypthread_timer_reset
+			w->curr->preempt_pending = 0;
+			mypthread_timer_reset();
+			mypthread_timer_unblock();
+			return;
+		}
+	}
 
 // schedule policy
 #ifndef MLFQ
 	// Choose STCF
-	sched_stcf();
+	sched_stcf(reason, used);
 #else
 	// Choose MLFQ
+	sched_mlfq(reason, used);
 #endif
 
 }
@@ -4,7 +4,9 @@
 // username of iLab: afl59
 // iLab Server: 
 
+#ifndef _XOPEN_SOURCE
 #define _XOPEN_SOURCE 600
+#endif
 
 #ifndef MYTHREAD_T_H
 #define MYTHREAD_T_H
@@ -23,8 +25,47 @@
 #include <ucontext.h>
 #include <stdatomic.h>
 
+/* thread handle: a slot in the library's handle table plus the slot's
+ * generation, so handles are recycled but a stale one is never mistaken
+ * for a newer thread */
 typedef uint mypthread_t;
 
+typedef uint mypthread_key_t;
+
+/* thread-specific data keys, like PTHREAD_KEYS_MAX */
+#define MYPTHREAD_KEYS_MAX 1024
+
+/* initial slots per worker run queue deque, power of two. Deques double
+ * when full. */
+#define MYPTHREAD_DEQUE_SIZE 4096
+
+/* MLFQ priority levels, 0 is the highest */
+#define MYPTHREAD_MLFQ_LEVELS 4
+
+/* switch events kept per worker when tracing, power of two */
+#define MYPTHREAD_TRACE_SIZE 65536
+
+/* per-thread runtime statistics, see mypthread_getstats */
+typedef struct mypthread_stats {
+	long cpu_ns; // cpu time actually consumed, from the worker's thread clock
+	long run_ns; // on a cpu, wall clock
+	long ready_ns; // runnable, waiting for a cpu
+	long blocked_ns; // waiting on a mutex, join, condition...
+	long mutex_wait_ns; // the part of blocked_ns spent in mypthread_mutex_lock
+	uint quanta; // times it got the cpu, or kept it at a timer tick
+	uint preempted; // switched out by the timer
+	uint yields;
+	uint blocks;
+} mypthread_stats_t;
+
+/* one context switch on a worker, tid -1 is the worker's idle loop */
+typedef struct mypthread_trace_event {
+	long ts; // CLOCK_MONOTONIC ns
+	int from;
+	int to;
+	int reason; // why `from` left the cpu
+} mypthread_trace_event_t;
+
 typedef struct threadControlBlock {
 	/* add important states in a thread control block */
 	// thread Id
@@ -37,44 +78,188 @@ typedef struct threadControlBlock {
 	// YOUR CODE HERE
 	uint tid;
 	int status; // 0:ready, 1:blocked, -1:completed
-	uint age;
-	ucontext_t context;
-	void* stack;
+	int detached; // reclaimed at exit instead of by mypthread_join
+	uint age; // full quanta of cpu used
+	long slice_ns; // cpu used towards the current quantum
+	uint level; // MLFQ queue level
+	uint epoch; // MLFQ boost epoch the level belongs to
+	int prio; // attr's sched_priority under SCHED_FIFO/RR, 0 otherwise
+	int credit; // STCF: quanta it may still use before the round is over for it
+	atomic_uint pi_count; // contended mutexes we hold whose waiters lend us priority
+	atomic_uint pi_level; // MLFQ: 1 + best level those waiters lent us, 0 for none
+	unsigned long affinity; // workers it prefers to run on, bit i is worker i, 0 for any
+	ucontext_t context; // portable switch backend
+	void* sp; // x86-64 switch backend: saved stack pointer
+	atomic_int preempt_off; // in the scheduler, the timer must not switch us
+	int preempt_pending; // a tick arrived while preempt_off was set
+	void* stack; // usable top part of the mapping, the guard pages sit below
+	size_t stack_size;
+	size_t guard_size;
 	void* (*func)(void*);
 	void* arg;
 	void* retval;
+	atomic_int on_cpu; // still switching out somewhere, don't resume yet
+	mypthread_stats_t stats;
+	long stamp; // when the thread last started running, waiting or blocking
+	// thread-specific data, indexed by key. Private to the thread and cache
+	// line aligned, so it swaps with the tcb and shares no line with others
+	struct mypthread_specific {
+		uint seq; // the key's seq when set, stale once the key is deleted
+		void* data;
+	} *specific;
+	uint nspecific;
+	struct mypthread_io {
+		int op; // for the offload pool: what to do with fd, buf and count
+		int fd;
+		void* buf;
+		size_t count;
+		ssize_t ret; // and how it went
+		int err;
+		long wake_ns; // mypthread_sleep deadline, CLOCK_MONOTONIC
+		uint events; // what mypthread_io_wait waits on fd for
+	} io;
+	struct qnode {
+		struct threadControlBlock* data;
+		struct qnode* next;
+	} node; // a tcb sits on at most one queue, so its link lives here
+	struct queue {
+		struct qnode* head;
+		struct qnode* tail;
+		uint size;
+	} joiners; // threads blocked in mypthread_join on this one
 } tcb;
 
-typedef struct qnode {
-    tcb* data;
-    struct qnode* next;
-} qnode_t;
+typedef struct qnode qnode_t;
 
-typedef struct queue {
-	qnode_t* head;
-	uint size;
-} queue_t;
+typedef struct queue queue_t;
 
 /* mutex struct definition */
 typedef struct mypthread_mutex_t {
 	/* add something here */
 
 	// YOUR CODE HERE
-	volatile atomic_flag flag;
+	atomic_int state; // 0 unlocked, 1 locked, 2 locked and maybe waiters
 	int status;
-	uint owner; // tid of who locked the mutex
-	queue_t* blocked; // all tcbs waiting for this mutex
+	tcb* owner; // who locked the mutex, NULL when free
+	tcb* lent_to; // owner the waiters lent their priority to, see mypthread_mutex_lend
+	int spins; // running average of spins that paid off, caps the next spin
+	atomic_flag guard; // protects blocked and handoff
+	int handoff; // a waiter is starving, unlock passes ownership to it
+	queue_t blocked; // all tcbs waiting for this mutex, in arrival order
 } mypthread_mutex_t;
 
+/* condition variable */
+typedef struct mypthread_cond_t {
+	int status;
+	atomic_flag guard; // protects waiters
+	queue_t waiters;
+} mypthread_cond_t;
+
+/* read-write lock, reader-preferring unless the attr asks for writers */
+typedef struct mypthread_rwlock_t {
+	int status;
+	int prefer_writer;
+	atomic_flag guard; // protects everything below
+	uint readers; // threads holding it for reading
+	uint writer; // tid holding it for writing, -1 when none
+	queue_t readq;
+	queue_t writeq;
+} mypthread_rwlock_t;
+
+/* barrier */
+typedef struct mypthread_barrier_t {
+	int status;
+	uint count;
+	atomic_flag guard; // protects arrived and waiters
+	uint arrived;
+	queue_t waiters;
+} mypthread_barrier_t;
+
+/* tasks spawned together and waited for together. pending counts them plus
+ * one reference held for the syncing thread */
+typedef struct mypthread_task_group_t {
+	atomic_long pending;
+	tcb* waiter; // thread in mypthread_task_sync
+} mypthread_task_group_t;
+
+/* bounded multi-producer multi-consumer channel of pointers */
+typedef struct mypthread_chan_t {
+	int status;
+	ulong mask; // capacity - 1
+	struct mypthread_chan_slot {
+		atomic_ulong seq; // == position when free, position + 1 when full
+		void* item;
+	} *slot;
+	_Alignas(64) atomic_ulong send_pos; // next position to fill
+	_Alignas(64) atomic_ulong recv_pos; // next position to drain
+	_Alignas(64) atomic_flag guard; // protects the queues
+	atomic_uint send_waiting; // parked on sendq, or about to
+	atomic_uint recv_waiting;
+	queue_t sendq;
+	queue_t recvq;
+	atomic_int closed;
+} mypthread_chan_t;
+
 /* define your data structures here: */
 // Feel free to add your own auxiliary data structures (linked list or queue etc...)
 
 // YOUR CODE HERE
 
+/* Chase-Lev deque: the owning worker pushes and pops at the bottom,
+ * idle workers steal from the top */
+typedef struct wsarray {
+	long size;
+	struct wsarray* prev; // the one this replaced, thieves may still read it
+	tcb* _Atomic slot[];
+} wsarray_t;
+
+typedef struct wsdeque {
+	_Alignas(64) atomic_long top;
+	_Alignas(64) atomic_long bottom;
+	wsarray_t* _Atomic array;
+} wsdeque_t;
+
+/* kernel thread running user threads (M:N mode runs several of these) */
+typedef struct worker {
+	uint id;
+	pid_t ktid; // kernel thread id, target of this worker's timer signal
+	timer_t timer;
+	long cpu_stamp; // worker thread cpu clock when curr was last charged
+	long timer_deadline; // cpu mode: worker cpu clock the armed timer fires at
+	clockid_t cpu_clock; // coop mode: this worker's cpu clock, for the watchdog
+	atomic_long coop_deadline; // coop mode: curr is out of time at this cpu time
+	atomic_int should_yield; // coop mode: set by the watchdog, see mypthread_checkpoint
+	tcb* curr; // user thread running here, NULL while idle
+	tcb* prev; // thread switched away from, finished by whoever runs next
+	int prev_reason;
+	atomic_uint nswitch; // bumped on every switch, lets readers detect migration
+	// run queue. STCF uses rq[0] and rq[1] as this round's threads and those
+	// done with it; MLFQ uses one deque per level as a FIFO
+	wsdeque_t rq[MYPTHREAD_MLFQ_LEVELS];
+	wsdeque_t* active;
+	wsdeque_t* expired;
+	uint rq_bitmap; // MLFQ: levels that may be non-empty
+	uint epoch; // MLFQ: last boost applied to this worker's queues
+	atomic_flag inbox_lock;
+	queue_t inbox; // threads with affinity for this worker, made ready elsewhere
+	mypthread_trace_event_t* trace; // ring of recent switches, NULL unless tracing
+	atomic_ulong trace_head; // events ever recorded; only this worker writes
+	ucontext_t idle_context; // this worker's schedule() loop
+	void* idle_sp;
+	void* idle_stack;
+} worker_t;
+
 
 /* Function Declarations: */
 
-/* create a new thread */
+/* create a new thread. attr (may be NULL) sets the stack and guard size,
+ * a priority and a worker affinity:
+ *   - pthread_attr_setschedpolicy SCHED_FIFO or SCHED_RR plus
+ *     pthread_attr_setschedparam mark a latency-critical thread. Under STCF
+ *     it gets 1 + sched_priority quanta per round, under MLFQ the bottom
+ *     sched_priority levels are closed to it, so 3 or more keeps it on top.
+ *   - pthread_attr_setaffinity_np names workers (not cpus) to run on.
+ *     Only a hint: idle workers still steal the thread. */
 int mypthread_create(mypthread_t * thread, pthread_attr_t * attr, void
     *(*function)(void*), void * arg);
 
@@ -84,9 +269,17 @@ int mypthread_yield();
 /* terminate a thread */
 void mypthread_exit(void *value_ptr);
 
+/* safepoint for MYPTHREAD_TIMER=coop: yield if this thread's quantum is up.
+ * Mutex ops, the I/O calls and task boundaries already check; long compute
+ * loops should call it every so often. Costs a load in the other modes */
+void mypthread_checkpoint(void);
+
 /* wait for thread termination */
 int mypthread_join(mypthread_t thread, void **value_ptr);
 
+/* reclaim the thread when it exits, it can't be joined any more */
+int mypthread_detach(mypthread_t thread);
+
 /* initial the mutex lock */
 int mypthread_mutex_init(mypthread_mutex_t *mutex, const pthread_mutexattr_t
     *mutexattr);
@@ -100,16 +293,115 @@ int mypthread_mutex_unlock(mypthread_mutex_t *mutex);
 /* destroy the mutex */
 int mypthread_mutex_destroy(mypthread_mutex_t *mutex);
 
+/* runtime statistics of a thread that has not been joined yet */
+int mypthread_getstats(mypthread_t thread, mypthread_stats_t *stats);
+
+/* write the switch trace as Chrome trace JSON (chrome://tracing, Perfetto).
+ * Only available when MYPTHREAD_TRACE was set at startup. */
+int mypthread_trace_dump(const char *path);
+
+/* thread-specific data */
+int mypthread_key_create(mypthread_key_t *key, void (*destructor)(void*));
+int mypthread_key_delete(mypthread_key_t key);
+void *mypthread_getspecific(mypthread_key_t key);
+int mypthread_setspecific(mypthread_key_t key, const void *value);
+
+/* I/O that parks the calling thread instead of blocking its worker. Pipes,
+ * sockets and ttys are read and written without waiting and waited on with
+ * epoll, by any number of threads per fd; the fd's own flags are left as
+ * they were. Regular files are tried without waiting for the disk, and handed
+ * to a few helper kernel threads if they must. */
+ssize_t mypthread_read(int fd, void *buf, size_t count);
+ssize_t mypthread_write(int fd, const void *buf, size_t count);
+
+/* sleep without blocking the worker */
+unsigned int mypthread_sleep(unsigned int seconds);
+int mypthread_usleep(useconds_t usec);
+
+/* condition variables */
+int mypthread_cond_init(mypthread_cond_t *cond, const pthread_condattr_t *condattr);
+int mypthread_cond_wait(mypthread_cond_t *cond, mypthread_mutex_t *mutex);
+int mypthread_cond_signal(mypthread_cond_t *cond);
+int mypthread_cond_broadcast(mypthread_cond_t *cond);
+int mypthread_cond_destroy(mypthread_cond_t *cond);
+
+/* read-write locks */
+int mypthread_rwlock_init(mypthread_rwlock_t *rwlock, const pthread_rwlockattr_t
+    *rwlockattr);
+int mypthread_rwlock_rdlock(mypthread_rwlock_t *rwlock);
+int mypthread_rwlock_tryrdlock(mypthread_rwlock_t *rwlock);
+int mypthread_rwlock_wrlock(mypthread_rwlock_t *rwlock);
+int mypthread_rwlock_trywrlock(mypthread_rwlock_t *rwlock);
+int mypthread_rwlock_unlock(mypthread_rwlock_t *rwlock);
+int mypthread_rwlock_destroy(mypthread_rwlock_t *rwlock);
+
+/* barriers */
+int mypthread_barrier_init(mypthread_barrier_t *barrier, const pthread_barrierattr_t
+    *barrierattr, unsigned count);
+int mypthread_barrier_wait(mypthread_barrier_t *barrier);
+int mypthread_barrier_destroy(mypthread_barrier_t *barrier);
+
+/* tasks: functions run to completion by a runner thread per worker, with no
+ * stack or context of their own. fn must not exit the thread running it */
+int mypthread_task_group_init(mypthread_task_group_t *group);
+int mypthread_task_spawn(mypthread_task_group_t *group, void (*fn)(void*), void *arg);
+int mypthread_task_sync(mypthread_task_group_t *group);
+
+/* run body(lo, hi, arg) over [begin, end) cut into tiles of grain
+ * iterations (grain <= 0 picks one), spread over the runners and the
+ * caller. Returns once every tile is done */
+int mypthread_parallel_for(long begin, long end, long grain,
+    void (*body)(long lo, long hi, void *arg), void *arg);
+
+/* channels: send blocks while full, recv while empty. The batch calls move
+ * many items per claim and wakeup; recv_batch returns as soon as it has at
+ * least one. Once closed, sends fail with EPIPE and receives drain what is
+ * left, then fail with EPIPE too */
+int mypthread_chan_init(mypthread_chan_t *chan, size_t capacity);
+int mypthread_chan_send(mypthread_chan_t *chan, void *item);
+int mypthread_chan_recv(mypthread_chan_t *chan, void **item);
+int mypthread_chan_trysend(mypthread_chan_t *chan, void *item);
+int mypthread_chan_tryrecv(mypthread_chan_t *chan, void **item);
+int mypthread_chan_send_batch(mypthread_chan_t *chan, void *const *items, size_t count);
+int mypthread_chan_recv_batch(mypthread_chan_t *chan, void **items, size_t count,
+    size_t *received);
+int mypthread_chan_close(mypthread_chan_t *chan);
+int mypthread_chan_destroy(mypthread_chan_t *chan);
+
 #ifdef USE_MYTHREAD
 #define pthread_t mypthread_t
 #define pthread_mutex_t mypthread_mutex_t
 #define pthread_create mypthread_create
 #define pthread_exit mypthread_exit
 #define pthread_join mypthread_join
+#define pthread_detach mypthread_detach
 #define pthread_mutex_init mypthread_mutex_init
 #define pthread_mutex_lock mypthread_mutex_lock
 #define pthread_mutex_unlock mypthread_mutex_unlock
 #define pthread_mutex_destroy mypthread_mutex_destroy
+#define pthread_key_t mypthread_key_t
+#define pthread_key_create mypthread_key_create
+#define pthread_key_delete mypthread_key_delete
+#define pthread_getspecific mypthread_getspecific
+#define pthread_setspecific mypthread_setspecific
+#define pthread_cond_t mypthread_cond_t
+#define pthread_cond_init mypthread_cond_init
+#define pthread_cond_wait mypthread_cond_wait
+#define pthread_cond_signal mypthread_cond_signal
+#define pthread_cond_broadcast mypthread_cond_broadcast
+#define pthread_cond_destroy mypthread_cond_destroy
+#define pthread_rwlock_t mypthread_rwlock_t
+#define pthread_rwlock_init mypthread_rwlock_init
+#define pthread_rwlock_rdlock mypthread_rwlock_rdlock
+#define pthread_rwlock_tryrdlock mypthread_rwlock_tryrdlock
+#define pthread_rwlock_wrlock mypthread_rwlock_wrlock
+#define pthread_rwlock_trywrlock mypthread_rwlock_trywrlock
+#define pthread_rwlock_unlock mypthread_rwlock_unlock
+#define pthread_rwlock_destroy mypthread_rwlock_destroy
+#define pthread_barrier_t mypthread_barrier_t
+#define pthread_barrier_init mypthread_barrier_init
+#define pthread_barrier_wait mypthread_barrier_wait
+#define pthread_barrier_destroy mypthread_barrier_destroy
 #endif
 
 #endif
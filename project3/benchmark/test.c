@@ -67,8 +67,10 @@ int main(int argc, char** argv) {
     myfree(b, SIZE*SIZE*4);
     myfree(c, SIZE*SIZE*4);
 
+    // Small allocations share pages and larger ones are aligned runs, so
+    // only an allocation of the same size is sure to land where a was
     printf("Checking if allocations were freed!\n");
-    a = myalloc(100*4);
+    a = myalloc(SIZE*SIZE*4);
     printf("a: %p\n", a);
     if ((int)a == old_a)
         printf("free function works\n");
@@ -27,16 +27,48 @@ typedef unsigned long pde_t;
 
 #define TLB_SIZE 120
 
+// Associativity of the TLB, a power of two that divides TLB_SIZE
+#ifndef TLB_WAYS
+#define TLB_WAYS 4
+#endif
+#define TLB_SETS (TLB_SIZE / TLB_WAYS)
+
+#if (TLB_WAYS & (TLB_WAYS - 1)) || TLB_WAYS > 32 || TLB_SIZE % TLB_WAYS
+#error "TLB_WAYS must be a power of two up to 32 that divides TLB_SIZE"
+#endif
+
 //Structure to represents TLB
 typedef struct tlb {
-    void* va;
-    void* pa;
-    unsigned long ts;   // Timestamp for 
-    //Assume your TLB is a direct mapped TLB of TBL_SIZE (entries)
-    // You must also define wth TBL_SIZE in this file.
-    //Assume each bucket to be 4 bytes
+    void* va;   // Virtual page number, NULL when the way is empty
+    void* pa;   // Base of the physical frame
 } tlb_t;
-tlb_t tlb_store[TLB_SIZE];
+
+// One set of the TLB. A page can only live in the set its page number
+// hashes to, so lookups and fills look at TLB_WAYS entries.
+typedef struct tlb_set {
+    tlb_t way[TLB_WAYS];
+    unsigned int plru;  // Tree pseudo-LRU bits, node n is bit n (1 is the root)
+} tlb_set_t;
+
+// Every thread that translates gets a TLB of its own, so threads neither
+// lock around it nor evict each other's pages. myfree shoots pages down by
+// logging them, each TLB drops them the next time its thread translates.
+typedef struct tlb_thread {
+    tlb_set_t tlb_store[TLB_SETS];
+    unsigned long epoch;    // Shootdowns this TLB has caught up with
+    unsigned long total;    // TLB call count
+    unsigned long miss;     // Miss count
+    struct tlb_stats* stats;
+} tlb_thread_t;
+
+// Hit and miss counts of a thread, kept after it exits for print_TLB_missrate
+typedef struct tlb_stats {
+    int id;                 // Threads are numbered in order of first translation
+    unsigned long total;
+    unsigned long miss;
+    tlb_thread_t* tlb;      // NULL once the thread has exited
+    struct tlb_stats* next;
+} tlb_stats_t;
 
 
 void SetPhysicalMem();